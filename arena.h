@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "unique_ptr.h"
+
+// Monotonic allocator for objects that die together, e.g. everything a request allocates.
+// Allocate bumps a pointer through a chunk, memory is only given back by Reset and by the
+// destructor. Not thread-safe, use one arena per thread (see Local).
+class Arena {
+public:
+    static constexpr size_t kDefaultChunkSize = 64 * 1024;
+    // Chunks double up to this size, so a steady workload ends up in a single chunk.
+    static constexpr size_t kMaxChunkSize = 1024 * 1024;
+
+    explicit Arena(size_t chunk_size_ = kDefaultChunkSize) noexcept : chunk_size(chunk_size_) {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        FreeChunks(nullptr);
+    }
+
+    // One arena per thread, for code that can't pass an arena around.
+    static Arena& Local() {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    void* Allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        uintptr_t begin = (current + align - 1) & ~(uintptr_t(align) - 1);
+        if (begin + size > end || current == 0)
+            return AllocateSlow(size, align);
+        current = begin + size;
+        return reinterpret_cast<void*>(begin);
+    }
+
+    // Every object allocated so far has to be destroyed already. Keeps the newest (largest)
+    // chunk, so the next round of allocations doesn't go to the heap.
+    void Reset() {
+        if (!head)
+            return;
+        FreeChunks(head);
+        head->prev = nullptr;
+        current = head->Data();
+        end = head->Data() + head->size;
+        used = 0;
+    }
+
+    // Bytes handed out since the last Reset, including the alignment padding between objects.
+    // The unused tails of full chunks are not counted.
+    size_t BytesUsed() const {
+        return used + (head ? current - head->Data() : 0);
+    }
+    // Bytes held in chunks.
+    size_t BytesReserved() const {
+        return reserved;
+    }
+
+private:
+    struct alignas(std::max_align_t) Chunk {
+        Chunk* prev;
+        size_t size;
+
+        uintptr_t Data() {
+            return reinterpret_cast<uintptr_t>(this + 1);
+        }
+    };
+
+    void* AllocateSlow(size_t size, size_t align) {
+        if (head)
+            used += current - head->Data();
+        size_t next_size = head ? std::min(head->size * 2, kMaxChunkSize) : chunk_size;
+        next_size = std::max(next_size, size + align);
+        Chunk* chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk) + next_size));
+        chunk->prev = head;
+        chunk->size = next_size;
+        head = chunk;
+        reserved += next_size;
+        current = chunk->Data();
+        end = current + next_size;
+        return Allocate(size, align);
+    }
+
+    // Frees the chunks older than keep, or all of them.
+    void FreeChunks(Chunk* keep) {
+        Chunk* chunk = keep ? keep->prev : head;
+        while (chunk) {
+            Chunk* prev = chunk->prev;
+            reserved -= chunk->size;
+            ::operator delete(chunk);
+            chunk = prev;
+        }
+    }
+
+    size_t chunk_size;
+    Chunk* head = nullptr;
+    uintptr_t current = 0;
+    uintptr_t end = 0;
+    // Bytes used in the chunks before head.
+    size_t used = 0;
+    size_t reserved = 0;
+};
+
+// Runs the destructor and leaves the memory to the arena, so it has no state and costs
+// nothing in a UniquePtr. Trivially destructible objects are not touched at all.
+template <typename T>
+struct ArenaDeleter {
+    ArenaDeleter() noexcept = default;
+
+    template <typename Tp, typename = typename std::enable_if_t<std::is_convertible_v<Tp*, T*>>>
+    ArenaDeleter(const ArenaDeleter<Tp>&) noexcept {
+    }
+
+    void operator()(T* ptr_) const {
+        static_assert(!std::is_void_v<T>);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            ptr_->~T();
+    }
+};
+
+template <typename T>
+using ArenaUniquePtr = UniquePtr<T, ArenaDeleter<T>>;
+
+// The result has to be destroyed before the arena is reset or destroyed.
+template <typename T, typename... Args>
+ArenaUniquePtr<T> MakeUniqueInArena(Arena& arena, Args&&... args) {
+    static_assert(!std::is_array_v<T>);
+    void* buffer = arena.Allocate(sizeof(T), alignof(T));
+    return ArenaUniquePtr<T>(new (buffer) T(std::forward<Args>(args)...));
+}
+
+static_assert(sizeof(ArenaUniquePtr<int>) == sizeof(void*));
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "shared_weak_fwd.h"
+#include "control_block.h"
+#include "shared_ptr.h"
+
+// Owns a SharedPtr whose stored pointer differs from the address the control block knows
+// (aliasing or a base class at a non-zero offset), so that AtomicSharedPtr can always
+// derive the object from the block alone.
+template <typename T>
+class ControlBlockAliasImp : public WideControlBlock {
+public:
+    ControlBlockAliasImp(SharedPtr<T>&& ptr) noexcept
+        : WideControlBlock(&ControlBlockOpsFor<ControlBlockAliasImp>::value),
+          owner(std::move(ptr)) {
+        object = owner.Get();
+    }
+    ~ControlBlockAliasImp() = default;
+
+    void DelObject() {
+        owner.Reset();
+    }
+
+    void DelThis() {
+        delete this;
+    }
+
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(object));
+    }
+
+private:
+    SharedPtr<T> owner;
+    typename SharedPtr<T>::element_type* object;
+};
+
+// Lock-free on x86-64: the control block pointer shares one word with a 16-bit count of
+// references handed out to readers. Every stored block carries a batch of references taken
+// in advance, so Load is a single fetch_add on the word and never touches the block's
+// counters until the batch runs low. Store gives the unused part of the batch back.
+template <typename T>
+class AtomicSharedPtr {
+public:
+    AtomicSharedPtr() noexcept : word(0) {
+    }
+    AtomicSharedPtr(SharedPtr<T> desired) : word(Prepare(std::move(desired))) {
+    }
+
+    AtomicSharedPtr(const AtomicSharedPtr&) = delete;
+    AtomicSharedPtr& operator=(const AtomicSharedPtr&) = delete;
+
+    ~AtomicSharedPtr() {
+        Settle(word.load(std::memory_order_relaxed));
+    }
+
+    SharedPtr<T> Load() const {
+        return Claim(word.fetch_add(kOne, std::memory_order_acquire));
+    }
+
+    void Store(SharedPtr<T> desired) {
+        Exchange(std::move(desired));
+    }
+
+    SharedPtr<T> Exchange(SharedPtr<T> desired) {
+        uintptr_t fresh = Prepare(std::move(desired));
+        return Settle(word.exchange(fresh, std::memory_order_acq_rel));
+    }
+
+    // On failure expected is replaced with the value the comparison saw: a reference is taken
+    // from the batch of exactly that word, as Load does.
+    bool CompareExchange(SharedPtr<T>& expected, SharedPtr<T> desired) {
+        uintptr_t fresh = Prepare(std::move(desired));
+        uintptr_t current = word.load(std::memory_order_relaxed);
+        while (true) {
+            if (Matches(current, expected)) {
+                if (word.compare_exchange_weak(current, fresh, std::memory_order_acq_rel,
+                                               std::memory_order_relaxed)) {
+                    Settle(current);
+                    return true;
+                }
+            } else if (!Block(current)) {
+                break;
+            } else if (word.compare_exchange_weak(current, current + kOne,
+                                                  std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        Settle(fresh);
+        expected = Claim(current);
+        return false;
+    }
+
+    operator SharedPtr<T>() const {
+        return Load();
+    }
+
+    AtomicSharedPtr& operator=(SharedPtr<T> desired) {
+        Store(std::move(desired));
+        return *this;
+    }
+
+private:
+    static_assert(sizeof(uintptr_t) == 8, "AtomicSharedPtr needs 64-bit pointers");
+
+    static constexpr int kPointerBits = 48;
+    static constexpr uintptr_t kOne = uintptr_t(1) << kPointerBits;
+    static constexpr uintptr_t kPointerMask = kOne - 1;
+    static constexpr size_t kBatch = size_t(1) << 14;
+
+    static ControlBlock* Block(uintptr_t value) {
+        return reinterpret_cast<ControlBlock*>(value & kPointerMask);
+    }
+    static size_t Used(uintptr_t value) {
+        return value >> kPointerBits;
+    }
+
+    // Turns the reference just taken from the batch of current into a SharedPtr.
+    SharedPtr<T> Claim(uintptr_t current) const {
+        ControlBlock* block = Block(current);
+        if (!block)
+            return SharedPtr<T>();
+
+        size_t used = Used(current);
+        if (used >= kBatch) {
+            // The batch is exhausted until someone refills it, pay for the reference ourselves.
+            block->IncRef();
+            GiveBack(block, 1);
+        } else if (used == kBatch / 2) {
+            block->IncRef(kBatch / 2);
+            GiveBack(block, kBatch / 2);
+        }
+        return Adopt(block);
+    }
+
+    static SharedPtr<T> Adopt(ControlBlock* block) {
+        SharedPtr<T> result;
+        result.block = block;
+        result.obj = static_cast<typename SharedPtr<T>::element_type*>(block->ObjectAddress());
+        return result;
+    }
+
+    static uintptr_t Prepare(SharedPtr<T>&& desired) {
+        ControlBlock* block = desired.block;
+        if (!block && !desired.obj)
+            return 0;
+        if (!block || block->ObjectAddress() != static_cast<const void*>(desired.obj))
+            block = new ControlBlockAliasImp<T>(std::move(desired));
+
+        desired.block = nullptr;
+        desired.obj = nullptr;
+        block->IncRef(kBatch);
+        return reinterpret_cast<uintptr_t>(block);
+    }
+
+    // Takes the value out of a word that is no longer installed: unused references of the
+    // batch are returned, references handed out beyond it are paid for.
+    static SharedPtr<T> Settle(uintptr_t value) {
+        ControlBlock* block = Block(value);
+        if (!block)
+            return SharedPtr<T>();
+
+        size_t used = Used(value);
+        if (used < kBatch)
+            block->DecRef(kBatch - used);
+        else if (used > kBatch)
+            block->IncRef(used - kBatch);
+        return Adopt(block);
+    }
+
+    // Puts n references we hold back into the batch of the installed word. If the block has
+    // been replaced meanwhile, its writer has already paid for our share in Settle.
+    void GiveBack(ControlBlock* block, size_t n) const {
+        uintptr_t current = word.load(std::memory_order_relaxed);
+        while (Block(current) == block && Used(current) >= n) {
+            if (word.compare_exchange_weak(current, current - n * kOne, std::memory_order_release,
+                                           std::memory_order_relaxed))
+                return;
+        }
+        block->DecRef(n);
+    }
+
+    // expected keeps its block alive, so the block can be inspected once the pointers match.
+    static bool Matches(uintptr_t value, const SharedPtr<T>& expected) {
+        ControlBlock* block = Block(value);
+        if (block != expected.block)
+            return false;
+        if (!block)
+            return !expected.obj;
+        return block->ObjectAddress() == static_cast<const void*>(expected.obj);
+    }
+
+    mutable std::atomic<uintptr_t> word;
+};
@@ -0,0 +1,1224 @@
+// Microbenchmarks of SharedPtr, WeakPtr, UniquePtr and MakeShared next to their standard
+// library counterparts. Every benchmark runs several times and keeps the fastest run.
+//
+// Usage: smart_ptrs_bench [--scale=F] [--filter=SUBSTRING] [--json=FILE]
+//   --scale   multiplies the number of operations and the size of the cold pools (default 1)
+//   --filter  runs only the benchmarks whose name contains SUBSTRING
+//   --json    where to write the results (default smart_ptrs_bench.json)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "atomic_shared_ptr.h"
+#include "cycle_collector.h"
+#include "polymorphic_deleter.h"
+#include "ptr_vector.h"
+#include "rcu_cell.h"
+#include "shared_ptr.h"
+#include "thin_shared_ptr.h"
+#include "unique_ptr.h"
+#include "weak_cache.h"
+#include "weak_ptr.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int kRepeats = 5;
+// Small enough to stay in L1, the cold pools are sized to miss all caches.
+constexpr size_t kWarmPool = 256;
+constexpr size_t kBaseOps = size_t(1) << 20;
+
+template <typename T>
+void DoNotOptimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static const void* volatile sink;
+    sink = &value;
+#endif
+}
+
+struct Payload {
+    explicit Payload(int64_t value_) : value(value_) {
+    }
+    int64_t value;
+};
+
+struct Ours {
+    template <typename T>
+    using Shared = SharedPtr<T>;
+    template <typename T>
+    using Weak = WeakPtr<T>;
+    template <typename T>
+    using Unique = UniquePtr<T>;
+
+    template <typename T, typename... Args>
+    static Shared<T> Make(Args&&... args) {
+        return MakeShared<T>(std::forward<Args>(args)...);
+    }
+    template <typename T>
+    static Shared<T> Lock(const Weak<T>& ptr) {
+        return ptr.Lock();
+    }
+    template <typename T>
+    static void Reset(Shared<T>& ptr) {
+        ptr.Reset();
+    }
+};
+
+struct Std {
+    template <typename T>
+    using Shared = std::shared_ptr<T>;
+    template <typename T>
+    using Weak = std::weak_ptr<T>;
+    template <typename T>
+    using Unique = std::unique_ptr<T>;
+
+    template <typename T, typename... Args>
+    static Shared<T> Make(Args&&... args) {
+        return std::make_shared<T>(std::forward<Args>(args)...);
+    }
+    template <typename T>
+    static Shared<T> Lock(const Weak<T>& ptr) {
+        return ptr.lock();
+    }
+    template <typename T>
+    static void Reset(Shared<T>& ptr) {
+        ptr.reset();
+    }
+};
+
+struct Options {
+    double scale = 1;
+    std::string filter;
+    std::string json = "smart_ptrs_bench.json";
+};
+
+// One row of the table: the same operation measured for both implementations, in ns per op.
+// A negative time means the implementation has no counterpart.
+struct Row {
+    std::string name;
+    double ours = -1;
+    double theirs = -1;
+};
+
+class Suite {
+public:
+    explicit Suite(const Options& options_) : options(options_) {
+    }
+
+    size_t Ops() const {
+        return std::max<size_t>(1, static_cast<size_t>(kBaseOps * options.scale));
+    }
+
+    bool Enabled(const std::string& name) const {
+        return name.find(options.filter) != std::string::npos;
+    }
+
+    // setup() builds a fresh state for every run outside of the timed region, run(state)
+    // performs ops operations on it. The state is destroyed untimed as well.
+    template <typename Setup, typename Run>
+    void Measure(const std::string& name, bool ours, size_t ops, Setup&& setup, Run&& run) {
+        if (!Enabled(name))
+            return;
+        double best = 0;
+        for (int i = 0; i < kRepeats; ++i) {
+            auto state = setup();
+            auto start = Clock::now();
+            run(state);
+            double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+            if (i == 0 || elapsed < best)
+                best = elapsed;
+        }
+        Row& row = GetRow(name);
+        (ours ? row.ours : row.theirs) = best / ops;
+    }
+
+    void PrintTable() const {
+        std::printf("%-44s %12s %12s %10s\n", "benchmark", "ours ns/op", "std ns/op", "ours/std");
+        for (const Row& row : rows) {
+            std::printf("%-44s ", row.name.c_str());
+            PrintTime(row.ours);
+            PrintTime(row.theirs);
+            if (row.ours >= 0 && row.theirs > 0)
+                std::printf("%10.2f\n", row.ours / row.theirs);
+            else
+                std::printf("%10s\n", "-");
+        }
+    }
+
+    bool WriteJson() const {
+        FILE* file = std::fopen(options.json.c_str(), "w");
+        if (!file)
+            return false;
+        std::fprintf(file, "{\n  \"scale\": %g,\n  \"repeats\": %d,\n  \"benchmarks\": [\n",
+                     options.scale, kRepeats);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const Row& row = rows[i];
+            std::fprintf(file, "    {\"name\": \"%s\", \"ours_ns_per_op\": ", row.name.c_str());
+            WriteJsonTime(file, row.ours);
+            std::fprintf(file, ", \"std_ns_per_op\": ");
+            WriteJsonTime(file, row.theirs);
+            std::fprintf(file, "}%s\n", i + 1 < rows.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        return std::fclose(file) == 0;
+    }
+
+private:
+    Row& GetRow(const std::string& name) {
+        for (Row& row : rows) {
+            if (row.name == name)
+                return row;
+        }
+        rows.push_back(Row{name});
+        return rows.back();
+    }
+
+    static void PrintTime(double time) {
+        if (time < 0)
+            std::printf("%12s ", "-");
+        else
+            std::printf("%12.2f ", time);
+    }
+
+    static void WriteJsonTime(FILE* file, double time) {
+        if (time < 0)
+            std::fprintf(file, "null");
+        else
+            std::fprintf(file, "%.3f", time);
+    }
+
+    Options options;
+    std::vector<Row> rows;
+};
+
+// Indices into a pool: the warm order cycles over a few pointers, the cold one visits a large
+// pool in random order so that every access misses the cache.
+std::vector<uint32_t> AccessOrder(size_t pool_size, size_t ops) {
+    std::vector<uint32_t> order(ops);
+    if (pool_size == ops) {
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+    } else {
+        for (size_t i = 0; i < ops; ++i)
+            order[i] = static_cast<uint32_t>(i % pool_size);
+    }
+    return order;
+}
+
+template <typename F>
+void ConstructionBenchmarks(Suite& suite, bool ours) {
+    using Shared = typename F::template Shared<Payload>;
+    size_t ops = suite.Ops();
+    auto reserved = [ops] {
+        std::vector<Shared> result;
+        result.reserve(ops);
+        return result;
+    };
+
+    suite.Measure("construct from new", ours, ops, reserved, [ops](std::vector<Shared>& out) {
+        for (size_t i = 0; i < ops; ++i)
+            out.emplace_back(new Payload(i));
+    });
+    suite.Measure("construct with MakeShared", ours, ops, reserved,
+                  [ops](std::vector<Shared>& out) {
+                      for (size_t i = 0; i < ops; ++i)
+                          out.push_back(F::template Make<Payload>(i));
+                  });
+
+    // Destroying the last reference frees the object and the block.
+    for (bool shuffled : {false, true}) {
+        auto made = [ops, shuffled] {
+            std::vector<Shared> result;
+            result.reserve(ops);
+            for (size_t i = 0; i < ops; ++i)
+                result.push_back(F::template Make<Payload>(i));
+            if (shuffled)
+                std::shuffle(result.begin(), result.end(), std::mt19937(42));
+            return result;
+        };
+        suite.Measure(shuffled ? "destroy last reference (cold)" : "destroy last reference (warm)",
+                      ours, ops, made, [](std::vector<Shared>& pool) { pool.clear(); });
+    }
+}
+
+template <typename F>
+void ReferenceBenchmarks(Suite& suite, bool ours, bool cold) {
+    using Shared = typename F::template Shared<Payload>;
+    using Weak = typename F::template Weak<Payload>;
+    size_t ops = suite.Ops();
+    size_t pool_size = cold ? ops : kWarmPool;
+    std::string suffix = cold ? " (cold)" : " (warm)";
+
+    std::vector<Shared> pool;
+    pool.reserve(pool_size);
+    for (size_t i = 0; i < pool_size; ++i)
+        pool.push_back(F::template Make<Payload>(i));
+    std::vector<Weak> weak(pool.begin(), pool.end());
+    std::vector<uint32_t> order = AccessOrder(pool_size, ops);
+
+    auto none = [] { return 0; };
+    auto copies = [&] {
+        std::vector<Shared> result;
+        result.reserve(ops);
+        return result;
+    };
+
+    suite.Measure("SharedPtr copy" + suffix, ours, ops, copies, [&](std::vector<Shared>& out) {
+        for (uint32_t index : order)
+            out.push_back(pool[index]);
+    });
+    suite.Measure(
+        "SharedPtr Reset (not last)" + suffix, ours, ops,
+        [&] {
+            std::vector<Shared> result;
+            result.reserve(ops);
+            for (uint32_t index : order)
+                result.push_back(pool[index]);
+            return result;
+        },
+        [](std::vector<Shared>& out) {
+            for (Shared& ptr : out)
+                F::Reset(ptr);
+        });
+    suite.Measure("SharedPtr move" + suffix, ours, ops, none, [&](int) {
+        for (uint32_t index : order) {
+            Shared moved = std::move(pool[index]);
+            DoNotOptimize(moved);
+            pool[index] = std::move(moved);
+        }
+    });
+    suite.Measure("WeakPtr Lock" + suffix, ours, ops, none, [&](int) {
+        for (uint32_t index : order) {
+            Shared locked = F::Lock(weak[index]);
+            DoNotOptimize(locked);
+        }
+    });
+    suite.Measure("WeakPtr from SharedPtr" + suffix, ours, ops, none, [&](int) {
+        for (uint32_t index : order) {
+            Weak observer(pool[index]);
+            DoNotOptimize(observer);
+        }
+    });
+    suite.Measure("dereference" + suffix, ours, ops, none, [&](int) {
+        int64_t sum = 0;
+        for (uint32_t index : order)
+            sum += pool[index]->value;
+        DoNotOptimize(sum);
+    });
+}
+
+template <typename F>
+void ContainerBenchmarks(Suite& suite, bool ours) {
+    using Shared = typename F::template Shared<Payload>;
+    using Unique = typename F::template Unique<Payload>;
+    size_t ops = suite.Ops();
+
+    std::vector<Shared> pool;
+    pool.reserve(ops);
+    for (size_t i = 0; i < ops; ++i)
+        pool.push_back(F::template Make<Payload>(i));
+    std::shuffle(pool.begin(), pool.end(), std::mt19937(42));
+    auto by_value = [](const auto& left, const auto& right) {
+        return left->value < right->value;
+    };
+
+    // No reserve: includes the moves on every reallocation.
+    suite.Measure(
+        "vector<SharedPtr> push_back", ours, ops, [] { return std::vector<Shared>(); },
+        [&](std::vector<Shared>& out) {
+            for (const Shared& ptr : pool)
+                out.push_back(ptr);
+        });
+    suite.Measure(
+        "vector<SharedPtr> sort", ours, ops, [&] { return pool; },
+        [&](std::vector<Shared>& out) { std::sort(out.begin(), out.end(), by_value); });
+
+    auto uniques = [&] {
+        std::vector<Unique> result;
+        result.reserve(ops);
+        for (const Shared& ptr : pool)
+            result.push_back(Unique(new Payload(ptr->value)));
+        return result;
+    };
+    suite.Measure(
+        "UniquePtr construct and destroy", ours, ops, [] { return 0; },
+        [ops](int) {
+            for (size_t i = 0; i < ops; ++i) {
+                Unique ptr(new Payload(i));
+                DoNotOptimize(ptr);
+            }
+        });
+    suite.Measure("UniquePtr move", ours, ops, uniques, [](std::vector<Unique>& out) {
+        for (Unique& ptr : out) {
+            Unique moved = std::move(ptr);
+            DoNotOptimize(moved);
+            ptr = std::move(moved);
+        }
+    });
+    suite.Measure("vector<UniquePtr> sort", ours, ops, uniques, [&](std::vector<Unique>& out) {
+        std::sort(out.begin(), out.end(), by_value);
+    });
+}
+
+template <template <typename> class Edge>
+struct TreeNode {
+    explicit TreeNode(int64_t value_) : value(value_) {
+    }
+
+    int64_t value;
+    std::vector<Edge<TreeNode>> children;
+};
+
+template <typename T>
+using StdShared = std::shared_ptr<T>;
+
+// The same node taking part in cycle collection.
+struct GraphNode {
+    explicit GraphNode(int64_t value_) : value(value_) {
+    }
+    void Trace(CycleTracer& tracer) {
+        for (CollectableSharedPtr<GraphNode>& child : children)
+            tracer(child);
+    }
+
+    int64_t value;
+    std::vector<CollectableSharedPtr<GraphNode>> children;
+};
+
+// Builds a tree of ops nodes with four children each, parents first.
+template <typename Make>
+auto BuildTree(size_t ops, Make&& make) {
+    std::vector<decltype(make(0))> nodes;
+    nodes.reserve(ops);
+    for (size_t i = 0; i < ops; ++i)
+        nodes.push_back(make(static_cast<int64_t>(i)));
+    for (size_t i = 1; i < ops; ++i)
+        nodes[(i - 1) / 4]->children.push_back(nodes[i]);
+    return nodes[0];
+}
+
+// The price of the collector on graphs without cycles: the same tree built and dropped with
+// each kind of edge. The collectable drop includes a full collection.
+void CycleBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    auto none = [] { return 0; };
+
+    suite.Measure("acyclic tree build and drop", true, ops, none, [ops](int) {
+        auto root = BuildTree(ops, [](int64_t value) {
+            return MakeShared<TreeNode<SharedPtr>>(value);
+        });
+        DoNotOptimize(root);
+    });
+    suite.Measure("acyclic tree build and drop", false, ops, none, [ops](int) {
+        auto root = BuildTree(ops, [](int64_t value) {
+            return std::make_shared<TreeNode<StdShared>>(value);
+        });
+        DoNotOptimize(root);
+    });
+    suite.Measure("acyclic tree build and drop (collectable)", true, ops, none, [ops](int) {
+        {
+            auto root = BuildTree(ops, [](int64_t value) {
+                return MakeCollectable<GraphNode>(value);
+            });
+            DoNotOptimize(root);
+        }
+        CycleCollector::Local().CollectAll();
+    });
+
+    // Rings of 64 nodes with no references from outside, reclaimed by the collector alone.
+    suite.Measure(
+        "collect garbage rings", true, ops,
+        [ops] {
+            std::vector<CollectableSharedPtr<GraphNode>> ring;
+            for (size_t i = 0; i < ops; ++i) {
+                ring.push_back(MakeCollectable<GraphNode>(static_cast<int64_t>(i)));
+                if (ring.size() == 64 || i + 1 == ops) {
+                    for (size_t j = 0; j < ring.size(); ++j)
+                        ring[j]->children.push_back(ring[(j + 1) % ring.size()]);
+                    ring.clear();
+                }
+            }
+            return 0;
+        },
+        [](int) { CycleCollector::Local().CollectAll(); });
+}
+
+// Objects made in groups, e.g. while parsing a message batch: one slab per group with
+// MakeSharedBatch, one allocation per object otherwise. The groups are kept and dropped
+// together.
+void BatchBenchmarks(Suite& suite) {
+    constexpr size_t kBatch = 64;
+    size_t batches = suite.Ops() / kBatch;
+    size_t ops = batches * kBatch;
+    auto none = [] { return 0; };
+
+    suite.Measure("construct and drop batches of 64", true, ops, none, [batches](int) {
+        for (size_t batch = 0; batch < batches; ++batch) {
+            auto group = MakeSharedBatch<Payload>(kBatch, [](size_t i) { return Payload(i); });
+            DoNotOptimize(group);
+        }
+    });
+    suite.Measure("construct and drop batches of 64", false, ops, none, [batches](int) {
+        for (size_t batch = 0; batch < batches; ++batch) {
+            std::vector<std::shared_ptr<Payload>> group;
+            group.reserve(kBatch);
+            for (size_t i = 0; i < kBatch; ++i)
+                group.push_back(std::make_shared<Payload>(i));
+            DoNotOptimize(group);
+        }
+    });
+}
+
+// Large containers of pointers: ThinSharedPtr halves the vector, the objects are the same.
+void ThinBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    std::vector<ThinSharedPtr<Payload>> thin;
+    std::vector<std::shared_ptr<Payload>> theirs;
+    thin.reserve(ops);
+    theirs.reserve(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        thin.push_back(MakeThinShared<Payload>(i));
+        theirs.push_back(std::make_shared<Payload>(i));
+    }
+    auto none = [] { return 0; };
+
+    suite.Measure("sum over vector<ThinSharedPtr>", true, ops, none, [&](int) {
+        int64_t sum = 0;
+        for (const ThinSharedPtr<Payload>& ptr : thin)
+            sum += ptr->value;
+        DoNotOptimize(sum);
+    });
+    suite.Measure("sum over vector<ThinSharedPtr>", false, ops, none, [&](int) {
+        int64_t sum = 0;
+        for (const std::shared_ptr<Payload>& ptr : theirs)
+            sum += ptr->value;
+        DoNotOptimize(sum);
+    });
+    suite.Measure("vector<ThinSharedPtr> copy", true, ops, none, [&](int) {
+        std::vector<ThinSharedPtr<Payload>> copy = thin;
+        DoNotOptimize(copy);
+    });
+    suite.Measure("vector<ThinSharedPtr> copy", false, ops, none, [&](int) {
+        std::vector<std::shared_ptr<Payload>> copy = theirs;
+        DoNotOptimize(copy);
+    });
+}
+
+// Objects built as UniquePtr and then shared: MakeUniqueShareable reserves the block up front,
+// the standard library allocates it on promotion.
+void PromotionBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    auto none = [] { return 0; };
+
+    suite.Measure("promote UniquePtr to SharedPtr", true, ops, none, [ops](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            ShareableUniquePtr<Payload> unique = MakeUniqueShareable<Payload>(i);
+            SharedPtr<Payload> shared(std::move(unique));
+            DoNotOptimize(shared);
+        }
+    });
+    suite.Measure("promote UniquePtr to SharedPtr", false, ops, none, [ops](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            std::unique_ptr<Payload> unique = std::make_unique<Payload>(i);
+            std::shared_ptr<Payload> shared(std::move(unique));
+            DoNotOptimize(shared);
+        }
+    });
+}
+
+struct SelfPayload : EnableSharedFromThis<SelfPayload> {
+    explicit SelfPayload(int64_t value_) : value(value_) {
+    }
+    int64_t value;
+};
+
+struct StdSelfPayload : std::enable_shared_from_this<StdSelfPayload> {
+    explicit StdSelfPayload(int64_t value_) : value(value_) {
+    }
+    int64_t value;
+};
+
+// EnableSharedFromThis stores one pointer to the block and takes no weak reference, the
+// standard one holds a weak_ptr that is set up when the object is made.
+void SelfBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    auto none = [] { return 0; };
+
+    suite.Measure("MakeShared with SharedFromThis", true, ops, none, [ops](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            SharedPtr<SelfPayload> shared = MakeShared<SelfPayload>(i);
+            DoNotOptimize(shared);
+        }
+    });
+    suite.Measure("MakeShared with SharedFromThis", false, ops, none, [ops](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            std::shared_ptr<StdSelfPayload> shared = std::make_shared<StdSelfPayload>(i);
+            DoNotOptimize(shared);
+        }
+    });
+
+    SharedPtr<SelfPayload> ours = MakeShared<SelfPayload>(1);
+    std::shared_ptr<StdSelfPayload> theirs = std::make_shared<StdSelfPayload>(1);
+    suite.Measure("SharedFromThis", true, ops, none, [&](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            SharedPtr<SelfPayload> self = ours->SharedFromThis();
+            DoNotOptimize(self);
+        }
+    });
+    suite.Measure("SharedFromThis", false, ops, none, [&](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            std::shared_ptr<StdSelfPayload> self = theirs->shared_from_this();
+            DoNotOptimize(self);
+        }
+    });
+}
+
+// The control block as it was before the ops table: DelObject and DelThis are virtual. Only
+// what creating a pointer and releasing the last reference need, as the baseline of
+// DispatchBenchmarks.
+class VirtualBlock {
+public:
+    void DecRef() {
+        if (use_count.fetch_sub(1, std::memory_order_release) == 1) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            DelObject();
+            DecWeakRef();
+        }
+    }
+
+protected:
+    virtual ~VirtualBlock() = default;
+    virtual void DelObject() = 0;
+    virtual void DelThis() = 0;
+
+private:
+    void DecWeakRef() {
+        if (weak_count.load(std::memory_order_acquire) == 1 ||
+            weak_count.fetch_sub(1, std::memory_order_release) == 1) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            DelThis();
+        }
+    }
+
+    std::atomic<size_t> use_count{1};
+    std::atomic<size_t> weak_count{1};
+};
+
+template <typename T>
+class VirtualObjectBlock : public VirtualBlock {
+public:
+    explicit VirtualObjectBlock(int64_t value) {
+        ::new (static_cast<void*>(&storage)) T(value);
+    }
+    T* Get() {
+        return std::launder(reinterpret_cast<T*>(&storage));
+    }
+
+private:
+    void DelObject() override {
+        Get()->~T();
+    }
+    void DelThis() override {
+        delete this;
+    }
+
+    std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+};
+
+template <typename T>
+class VirtualPointerBlock : public VirtualBlock {
+public:
+    explicit VirtualPointerBlock(T* ptr_) : ptr(ptr_) {
+    }
+
+private:
+    void DelObject() override {
+        delete ptr;
+    }
+    void DelThis() override {
+        delete this;
+    }
+
+    T* ptr;
+};
+
+// A move-only owner of a VirtualBlock, enough for a window of pointers.
+template <typename T>
+class VirtualShared {
+public:
+    VirtualShared() = default;
+    VirtualShared(VirtualBlock* block_, T* obj_) : block(block_), obj(obj_) {
+    }
+    VirtualShared(VirtualShared&& other) noexcept
+        : block(std::exchange(other.block, nullptr)), obj(std::exchange(other.obj, nullptr)) {
+    }
+    VirtualShared& operator=(VirtualShared&& other) noexcept {
+        VirtualShared(std::move(other)).Swap(*this);
+        return *this;
+    }
+    ~VirtualShared() {
+        if (block)
+            block->DecRef();
+    }
+    void Swap(VirtualShared& other) {
+        std::swap(block, other.block);
+        std::swap(obj, other.obj);
+    }
+
+private:
+    VirtualBlock* block = nullptr;
+    T* obj = nullptr;
+};
+
+// Before and after the ops table: the last reference is released through a block loaded from
+// memory, so DelObject and DelThis are real indirect calls in both. "std" is the virtual
+// baseline here. The adopted blocks also come from the pool, the made ones don't.
+void DispatchBenchmarks(Suite& suite) {
+    constexpr size_t kWindow = 1024;
+    size_t ops = suite.Ops();
+    auto none = [] { return 0; };
+
+    suite.Measure("make and release, ops table vs virtual", true, ops, none, [ops](int) {
+        std::vector<SharedPtr<Payload>> window(kWindow);
+        for (size_t i = 0; i < ops; ++i)
+            window[i % kWindow] = MakeShared<Payload>(i);
+        DoNotOptimize(window);
+    });
+    suite.Measure("make and release, ops table vs virtual", false, ops, none, [ops](int) {
+        std::vector<VirtualShared<Payload>> window(kWindow);
+        for (size_t i = 0; i < ops; ++i) {
+            auto* block = new VirtualObjectBlock<Payload>(i);
+            window[i % kWindow] = VirtualShared<Payload>(block, block->Get());
+        }
+        DoNotOptimize(window);
+    });
+
+    suite.Measure("adopt and release, ops table vs virtual", true, ops, none, [ops](int) {
+        std::vector<SharedPtr<Payload>> window(kWindow);
+        for (size_t i = 0; i < ops; ++i)
+            window[i % kWindow].Reset(new Payload(i));
+        DoNotOptimize(window);
+    });
+    suite.Measure("adopt and release, ops table vs virtual", false, ops, none, [ops](int) {
+        std::vector<VirtualShared<Payload>> window(kWindow);
+        for (size_t i = 0; i < ops; ++i) {
+            Payload* ptr = new Payload(i);
+            auto* block = new VirtualPointerBlock<Payload>(ptr);
+            window[i % kWindow] = VirtualShared<Payload>(block, ptr);
+        }
+        DoNotOptimize(window);
+    });
+}
+
+// Raw pointers adopted and released in a steady state, the blocks cycle through the pool of
+// the thread. In the handoff one thread adopts and another releases, so the blocks travel
+// through the depot.
+void AdoptBenchmarks(Suite& suite) {
+    constexpr size_t kWindow = 1024;
+    constexpr size_t kHandoff = 256;
+    size_t ops = suite.Ops();
+    auto none = [] { return 0; };
+
+    suite.Measure("adopt and release churn", true, ops, none, [ops](int) {
+        std::vector<SharedPtr<Payload>> window(kWindow);
+        for (size_t i = 0; i < ops; ++i)
+            window[i % kWindow].Reset(new Payload(i));
+        DoNotOptimize(window);
+    });
+    suite.Measure("adopt and release churn", false, ops, none, [ops](int) {
+        std::vector<std::shared_ptr<Payload>> window(kWindow);
+        for (size_t i = 0; i < ops; ++i)
+            window[i % kWindow].reset(new Payload(i));
+        DoNotOptimize(window);
+    });
+
+    auto handoff = [ops](auto make) {
+        using Ptr = decltype(make(0));
+        std::mutex mutex;
+        std::vector<Ptr> queue;
+        std::atomic<bool> done{false};
+        std::thread consumer([&] {
+            std::vector<Ptr> batch;
+            while (true) {
+                bool last = done.load();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    batch.swap(queue);
+                }
+                if (batch.empty() && last)
+                    return;
+                batch.clear();
+                std::this_thread::yield();
+            }
+        });
+        std::vector<Ptr> batch;
+        for (size_t i = 0; i < ops; ++i) {
+            batch.push_back(make(i));
+            if (batch.size() < kHandoff)
+                continue;
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.insert(queue.end(), std::make_move_iterator(batch.begin()),
+                         std::make_move_iterator(batch.end()));
+            batch.clear();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.insert(queue.end(), std::make_move_iterator(batch.begin()),
+                         std::make_move_iterator(batch.end()));
+        }
+        done.store(true);
+        consumer.join();
+    };
+    suite.Measure("adopt here, release there", true, ops, none, [&](int) {
+        handoff([](size_t i) { return SharedPtr<Payload>(new Payload(i)); });
+    });
+    suite.Measure("adopt here, release there", false, ops, none, [&](int) {
+        handoff([](size_t i) { return std::shared_ptr<Payload>(new Payload(i)); });
+    });
+}
+
+// Bulk inserts into and erases from the middle of a large vector of SharedPtrs, and growth of
+// a vector of UniquePtrs. PtrVector shifts the elements with memmove, std::vector moves them
+// one by one. Both hold the same pointers.
+void RelocationBenchmarks(Suite& suite) {
+    constexpr size_t kElements = 4096;
+    constexpr size_t kBulk = 16;
+    size_t rounds = std::max<size_t>(suite.Ops() / kElements, 1);
+    std::vector<SharedPtr<Payload>> bulk;
+    for (size_t i = 0; i < kBulk; ++i)
+        bulk.push_back(MakeShared<Payload>(i));
+    auto none = [] { return 0; };
+
+    suite.Measure("bulk insert and erase in the middle", true, rounds, none, [&](int) {
+        PtrVector<SharedPtr<Payload>> vector;
+        for (size_t i = 0; i < kElements; ++i)
+            vector.PushBack(bulk[i % kBulk]);
+        for (size_t round = 0; round < rounds; ++round) {
+            vector.Insert(vector.begin() + kElements / 2, bulk.begin(), bulk.end());
+            vector.Erase(vector.begin() + kElements / 4, vector.begin() + kElements / 4 + kBulk);
+        }
+        DoNotOptimize(vector);
+    });
+    suite.Measure("bulk insert and erase in the middle", false, rounds, none, [&](int) {
+        std::vector<SharedPtr<Payload>> vector;
+        for (size_t i = 0; i < kElements; ++i)
+            vector.push_back(bulk[i % kBulk]);
+        for (size_t round = 0; round < rounds; ++round) {
+            vector.insert(vector.begin() + kElements / 2, bulk.begin(), bulk.end());
+            vector.erase(vector.begin() + kElements / 4, vector.begin() + kElements / 4 + kBulk);
+        }
+        DoNotOptimize(vector);
+    });
+
+    size_t ops = suite.Ops();
+    suite.Measure("grow vector<UniquePtr> by push_back", true, ops, none, [ops](int) {
+        PtrVector<UniquePtr<Payload>> vector;
+        for (size_t i = 0; i < ops; ++i)
+            vector.EmplaceBack(new Payload(i));
+        DoNotOptimize(vector);
+    });
+    suite.Measure("grow vector<UniquePtr> by push_back", false, ops, none, [ops](int) {
+        std::vector<UniquePtr<Payload>> vector;
+        for (size_t i = 0; i < ops; ++i)
+            vector.emplace_back(new Payload(i));
+        DoNotOptimize(vector);
+    });
+}
+
+// A request allocates a few objects of mixed sizes and drops them all at its end: one
+// allocation and one free per object with new/delete, a pointer bump and one Reset per
+// request with the arena.
+void ArenaBenchmarks(Suite& suite) {
+    constexpr size_t kObjectsPerRequest = 32;
+    struct Large {
+        explicit Large(int64_t value_) : value(value_) {
+        }
+        int64_t value;
+        char padding[120] = {};
+    };
+    size_t requests = suite.Ops() / kObjectsPerRequest;
+    size_t ops = requests * kObjectsPerRequest;
+    auto none = [] { return 0; };
+
+    suite.Measure("request lifecycle", true, ops, none, [requests](int) {
+        Arena arena;
+        std::vector<ArenaUniquePtr<Payload>> small;
+        std::vector<ArenaUniquePtr<Large>> large;
+        for (size_t request = 0; request < requests; ++request) {
+            for (size_t i = 0; i < kObjectsPerRequest / 2; ++i) {
+                small.push_back(MakeUniqueInArena<Payload>(arena, i));
+                large.push_back(MakeUniqueInArena<Large>(arena, i));
+            }
+            DoNotOptimize(small);
+            DoNotOptimize(large);
+            small.clear();
+            large.clear();
+            arena.Reset();
+        }
+    });
+    suite.Measure("request lifecycle", false, ops, none, [requests](int) {
+        std::vector<std::unique_ptr<Payload>> small;
+        std::vector<std::unique_ptr<Large>> large;
+        for (size_t request = 0; request < requests; ++request) {
+            for (size_t i = 0; i < kObjectsPerRequest / 2; ++i) {
+                small.push_back(std::make_unique<Payload>(i));
+                large.push_back(std::make_unique<Large>(i));
+            }
+            DoNotOptimize(small);
+            DoNotOptimize(large);
+            small.clear();
+            large.clear();
+        }
+    });
+}
+
+// A scratch buffer per call that the kernel overwrites anyway: MakeUniqueForOverwrite skips
+// the zeroing make_unique does. Ops are elements.
+void AlignedBenchmarks(Suite& suite) {
+    constexpr size_t kElements = 4096;
+    size_t buffers = std::max<size_t>(suite.Ops() / kElements, 1);
+    size_t ops = buffers * kElements;
+    std::vector<float> input(kElements, 1.5f);
+    auto none = [] { return 0; };
+
+    suite.Measure("aligned scratch buffer", true, ops, none, [&](int) {
+        for (size_t buffer = 0; buffer < buffers; ++buffer) {
+            auto scratch = MakeUniqueAligned<float[]>(kElements, 64);
+            float* out = scratch.Get();
+            const float* in = input.data();
+            for (size_t i = 0; i < kElements; ++i)
+                out[i] = in[i] * 2.0f + 1.0f;
+            DoNotOptimize(out[buffer % kElements]);
+        }
+    });
+    suite.Measure("aligned scratch buffer", false, ops, none, [&](int) {
+        for (size_t buffer = 0; buffer < buffers; ++buffer) {
+            auto scratch = std::make_unique<float[]>(kElements);
+            float* out = scratch.get();
+            const float* in = input.data();
+            for (size_t i = 0; i < kElements; ++i)
+                out[i] = in[i] * 2.0f + 1.0f;
+            DoNotOptimize(out[buffer % kElements]);
+        }
+    });
+}
+
+// UniquePtrs with a capturing deleter, erased to one type: PolymorphicDeleter keeps the lambda
+// in its buffer and calls it through one function pointer, std::function is the usual way.
+void PolymorphicDeleterBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    auto none = [] { return 0; };
+    int64_t freed = 0;
+
+    suite.Measure("UniquePtr with type-erased deleter", true, ops, none, [&](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            AnyUniquePtr<Payload> ptr(new Payload(i), [&freed](Payload* payload) {
+                freed += payload->value;
+                delete payload;
+            });
+            DoNotOptimize(ptr);
+        }
+    });
+    suite.Measure("UniquePtr with type-erased deleter", false, ops, none, [&](int) {
+        for (size_t i = 0; i < ops; ++i) {
+            std::unique_ptr<Payload, std::function<void(Payload*)>> ptr(
+                new Payload(i), [&freed](Payload* payload) {
+                    freed += payload->value;
+                    delete payload;
+                });
+            DoNotOptimize(ptr);
+        }
+    });
+    DoNotOptimize(freed);
+}
+
+// Runs body(ops_per_thread) on threads threads at once, the time covers all of them.
+template <typename Body>
+void RunThreads(size_t threads, size_t ops, Body&& body) {
+    std::atomic<size_t> ready{0};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&] {
+            ready.fetch_add(1);
+            while (ready.load() < threads) {
+            }
+            body(ops / threads);
+        });
+    }
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+// All threads read the same value: copying a SharedPtr bounces its counter between cores,
+// AtomicSharedPtr does one RMW per load, RcuCell writes only thread-local state.
+void ContendedBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    std::string suffix = " (" + std::to_string(threads) + " threads)";
+    auto none = [] { return 0; };
+
+    // Copy and drop at 1 to 64 threads, the total number of copies stays the same.
+    SharedPtr<Payload> ours = MakeShared<Payload>(1);
+    std::shared_ptr<Payload> theirs = std::make_shared<Payload>(1);
+    for (size_t thread_count = 1; thread_count <= 64; thread_count *= 2) {
+        std::string name =
+            "contended SharedPtr copy (" + std::to_string(thread_count) + " threads)";
+        suite.Measure(name, true, ops, none, [&](int) {
+            RunThreads(thread_count, ops, [&](size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    SharedPtr<Payload> copy = ours;
+                    DoNotOptimize(copy);
+                }
+            });
+        });
+        suite.Measure(name, false, ops, none, [&](int) {
+            RunThreads(thread_count, ops, [&](size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    std::shared_ptr<Payload> copy = theirs;
+                    DoNotOptimize(copy);
+                }
+            });
+        });
+    }
+
+    AtomicSharedPtr<Payload> atomic_ours(ours);
+    suite.Measure("contended AtomicSharedPtr Load" + suffix, true, ops, none, [&](int) {
+        RunThreads(threads, ops, [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                SharedPtr<Payload> copy = atomic_ours.Load();
+                DoNotOptimize(copy);
+            }
+        });
+    });
+    suite.Measure("contended AtomicSharedPtr Load" + suffix, false, ops, none, [&](int) {
+        RunThreads(threads, ops, [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                std::shared_ptr<Payload> copy = std::atomic_load(&theirs);
+                DoNotOptimize(copy);
+            }
+        });
+    });
+
+    // Interning at a hit rate near 100%: the values stay referenced, every thread looks up
+    // random keys. The baseline is one mutex around a map of std::weak_ptr.
+    constexpr size_t kKeys = 4096;
+    std::vector<uint32_t> keys = AccessOrder(kKeys, ops);
+    WeakCache<uint32_t, Payload> cache;
+    std::vector<SharedPtr<Payload>> interned;
+    for (uint32_t key = 0; key < kKeys; ++key)
+        interned.push_back(cache.GetOrCreate(key, [key] { return Payload(key); }));
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+    suite.Measure("contended WeakCache GetOrCreate" + suffix, true, ops, none, [&](int) {
+        RunThreads(threads, ops, [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                uint32_t key = keys[i];
+                SharedPtr<Payload> value =
+                    cache.GetOrCreate(key, [key] { return Payload(key); });
+                DoNotOptimize(value);
+            }
+        });
+    });
+    std::mutex table_mutex;
+    std::unordered_map<uint32_t, std::weak_ptr<Payload>> table;
+    std::vector<std::shared_ptr<Payload>> std_interned;
+    for (uint32_t key = 0; key < kKeys; ++key) {
+        std_interned.push_back(std::make_shared<Payload>(key));
+        table[key] = std_interned.back();
+    }
+    suite.Measure("contended WeakCache GetOrCreate" + suffix, false, ops, none, [&](int) {
+        RunThreads(threads, ops, [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                uint32_t key = keys[i];
+                std::lock_guard<std::mutex> lock(table_mutex);
+                std::weak_ptr<Payload>& slot = table[key];
+                std::shared_ptr<Payload> value = slot.lock();
+                if (!value) {
+                    value = std::make_shared<Payload>(key);
+                    slot = value;
+                }
+                DoNotOptimize(value);
+            }
+        });
+    });
+
+    RcuCell<Payload> cell(ours);
+    suite.Measure("contended RcuCell Read" + suffix, true, ops, none, [&](int) {
+        RunThreads(threads, ops, [&](size_t count) {
+            int64_t sum = 0;
+            for (size_t i = 0; i < count; ++i)
+                sum += cell.Read()->value;
+            DoNotOptimize(sum);
+        });
+    });
+}
+
+// Readers load the current value while one writer keeps replacing it, at growing reader
+// counts. The baseline is a SharedPtr behind a std::mutex: readers copy it under the lock.
+void AtomicScalingBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    size_t max_readers = std::max(8u, std::thread::hardware_concurrency());
+    auto none = [] { return 0; };
+
+    // Runs read(count) on readers threads while write(version) runs in a loop on another one.
+    auto with_writer = [ops](size_t readers, auto&& read, auto&& write) {
+        std::atomic<bool> done{false};
+        std::thread writer([&] {
+            for (int64_t version = 0; !done.load(std::memory_order_relaxed); ++version) {
+                write(version);
+                std::this_thread::yield();
+            }
+        });
+        RunThreads(readers, ops, read);
+        done.store(true);
+        writer.join();
+    };
+
+    AtomicSharedPtr<Payload> atomic(MakeShared<Payload>(0));
+    std::mutex mutex;
+    SharedPtr<Payload> locked = MakeShared<Payload>(0);
+    for (size_t readers = 1; readers <= max_readers; readers *= 2) {
+        std::string name = "AtomicSharedPtr Load vs mutex (" + std::to_string(readers) +
+                           " readers, 1 writer)";
+        suite.Measure(name, true, ops, none, [&](int) {
+            with_writer(
+                readers,
+                [&](size_t count) {
+                    int64_t sum = 0;
+                    for (size_t i = 0; i < count; ++i)
+                        sum += atomic.Load()->value;
+                    DoNotOptimize(sum);
+                },
+                [&](int64_t version) { atomic.Store(MakeShared<Payload>(version)); });
+        });
+        suite.Measure(name, false, ops, none, [&](int) {
+            with_writer(
+                readers,
+                [&](size_t count) {
+                    int64_t sum = 0;
+                    for (size_t i = 0; i < count; ++i) {
+                        SharedPtr<Payload> copy;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            copy = locked;
+                        }
+                        sum += copy->value;
+                    }
+                    DoNotOptimize(sum);
+                },
+                [&](int64_t version) {
+                    SharedPtr<Payload> next = MakeShared<Payload>(version);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    locked.Swap(next);
+                });
+        });
+    }
+}
+
+// The same copy loop as "contended SharedPtr copy", at growing thread counts: with a sharded
+// count each thread mostly touches its own cache line, so the time per copy should stay flat.
+void ShardedBenchmarks(Suite& suite) {
+    size_t ops = suite.Ops();
+    size_t max_threads = std::max(4u, std::thread::hardware_concurrency());
+    auto none = [] { return 0; };
+
+    SharedPtr<Payload> ours = MakeSharedSharded<Payload>(1);
+    std::shared_ptr<Payload> theirs = std::make_shared<Payload>(1);
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        std::string name = "sharded SharedPtr copy (" + std::to_string(threads) + " threads)";
+        suite.Measure(name, true, ops, none, [&](int) {
+            RunThreads(threads, ops, [&](size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    SharedPtr<Payload> copy = ours;
+                    DoNotOptimize(copy);
+                }
+            });
+        });
+        suite.Measure(name, false, ops, none, [&](int) {
+            RunThreads(threads, ops, [&](size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    std::shared_ptr<Payload> copy = theirs;
+                    DoNotOptimize(copy);
+                }
+            });
+        });
+    }
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strncmp(arg, "--scale=", 8) == 0)
+            options->scale = std::atof(arg + 8);
+        else if (std::strncmp(arg, "--filter=", 9) == 0)
+            options->filter = arg + 9;
+        else if (std::strncmp(arg, "--json=", 7) == 0)
+            options->json = arg + 7;
+        else
+            return false;
+    }
+    return options->scale > 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, &options)) {
+        std::fprintf(stderr, "usage: %s [--scale=F] [--filter=SUBSTRING] [--json=FILE]\n",
+                     argv[0]);
+        return 2;
+    }
+    Suite suite(options);
+
+    ConstructionBenchmarks<Ours>(suite, true);
+    ConstructionBenchmarks<Std>(suite, false);
+    for (bool cold : {false, true}) {
+        ReferenceBenchmarks<Ours>(suite, true, cold);
+        ReferenceBenchmarks<Std>(suite, false, cold);
+    }
+    ContainerBenchmarks<Ours>(suite, true);
+    ContainerBenchmarks<Std>(suite, false);
+    BatchBenchmarks(suite);
+    PromotionBenchmarks(suite);
+    SelfBenchmarks(suite);
+    DispatchBenchmarks(suite);
+    AdoptBenchmarks(suite);
+    RelocationBenchmarks(suite);
+    ThinBenchmarks(suite);
+    ArenaBenchmarks(suite);
+    AlignedBenchmarks(suite);
+    PolymorphicDeleterBenchmarks(suite);
+    ContendedBenchmarks(suite);
+    AtomicScalingBenchmarks(suite);
+    ShardedBenchmarks(suite);
+    CycleBenchmarks(suite);
+
+    suite.PrintTable();
+    ControlBlockPool::Dump(stdout);
+    if constexpr (kInstrumentation)
+        Instrumentation::Dump(stdout, 10);
+    if (!suite.WriteJson()) {
+        std::fprintf(stderr, "cannot write %s\n", options.json.c_str());
+        return 1;
+    }
+    return 0;
+}
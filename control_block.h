@@ -1,49 +1,715 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include "compressed_pair.h"
+#include "control_block_pool.h"
+#include "instrumentation.h"
+
+class ControlBlock;
+class BiasedControlBlock;
+class ShardedControlBlock;
+class CycleTracer;
+
+// The address of id is unique for every deleter type.
+template <typename Deleter>
+struct DeleterId {
+    static constexpr char id = 0;
+};
+
+// Types with void Trace(CycleTracer&) take part in cycle collection, see cycle_collector.h.
+template <typename T, typename = void>
+struct HasTrace : std::false_type {};
+
+template <typename T>
+struct HasTrace<T, std::void_t<decltype(std::declval<T&>().Trace(std::declval<CycleTracer&>()))>>
+    : std::true_type {};
+
+// Installed by the CycleCollector of the thread while it exists. Receives traceable blocks
+// that lose a reference and stay alive, they are the candidate roots of garbage cycles.
+// Threads without a collector don't buffer anything.
+inline thread_local void (*cycle_candidate_hook)(ControlBlock*) = nullptr;
+
+// Replaces a vtable: one static table per block type, see ControlBlockOpsFor. Aligned to leave
+// four tag bits in the pointer to it.
+struct alignas(16) ControlBlockOps {
+    void (*del_object)(ControlBlock*);
+    void (*del_this)(ControlBlock*);
+    void* (*object_address)(ControlBlock*);
+    void* (*get_deleter)(ControlBlock*, const void*);
+    size_t (*object_count)(ControlBlock*);
+    // Only set for objects with a Trace method.
+    void (*trace)(ControlBlock*, CycleTracer&);
+    // Only set with SMART_PTRS_INSTRUMENT.
+    InstrumentedType* type;
+};
 
 class ControlBlock {
 public:
-    ControlBlock() noexcept : use_count(1), weak_use_count(1) {
+    void DelObject() {
+        if constexpr (kInstrumentation)
+            Trace(InstrumentedEvent::kFree, ObjectCount());
+        Ops()->del_object(this);
     }
-    virtual ~ControlBlock() {
+    void DelThis() {
+        Ops()->del_this(this);
     }
-
-    virtual void DelObject() {
+    // Address of the owned object as it was handed to the block.
+    void* ObjectAddress() {
+        return Ops()->object_address(this);
+    }
+    // Returns the stored deleter if its DeleterId matches id, works without RTTI.
+    void* GetDeleter(const void* id) {
+        return Ops()->get_deleter(this, id);
+    }
+    // Number of objects the block owns, more than one only for arrays.
+    size_t ObjectCount() {
+        return Ops()->object_count(this);
+    }
+    // Whether the block is of the type ops was built for, see ControlBlockOpsFor.
+    bool HasOps(const ControlBlockOps* ops_) const {
+        return Ops() == ops_;
     }
-    virtual void DelThis() {
+    // Passes the collectable members of the object to tracer.
+    void TraceObject(CycleTracer& tracer) {
+        Ops()->trace(this, tracer);
     }
-    void IncRef() {
-        if (++use_count == 1)
-            IncWeakRef();
+    // Called once the block is fully built and owns its object.
+    void RecordAllocation() {
+        if constexpr (kInstrumentation)
+            Trace(InstrumentedEvent::kAllocate, ObjectCount());
     }
-    void DecRef() {
-        if (--use_count == 0) {
+    // Copies only need the counter to stay consistent, the owner we copy from keeps the
+    // object alive, so a relaxed increment is enough.
+    void IncRef(size_t n = 1) {
+        Trace(InstrumentedEvent::kIncRef, n);
+        if (HasSplitCount())
+            return IsBiased() ? IncBiasedRef(n) : IncShardedRef(n);
+        size_t count = use_count.fetch_add(n, std::memory_order_relaxed);
+        if (IsCompact())
+            CheckCompactCount((count & kCompactMask) + n);
+    }
+    // Used by WeakPtr::Lock: never resurrects an object whose last owner is already gone.
+    bool IncRefIfNotZero() {
+        bool locked = TryIncRef();
+        Trace(locked ? InstrumentedEvent::kLockHit : InstrumentedEvent::kLockMiss);
+        return locked;
+    }
+    // Release publishes our writes to the object, the acquire fence on the last decrement
+    // makes all of them visible to the thread that destroys it.
+    void DecRef(size_t n = 1) {
+        Trace(InstrumentedEvent::kDecRef, n);
+        if (IsTraceable() && cycle_candidate_hook && UseCount() > n)
+            cycle_candidate_hook(this);
+        if (HasSplitCount())
+            return IsBiased() ? DecBiasedRef(n) : DecShardedRef(n);
+        if (IsCompact())
+            return DecCompactRef(n);
+        if (use_count.fetch_sub(n, std::memory_order_release) == n) {
+            std::atomic_thread_fence(std::memory_order_acquire);
             DelObject();
             DecWeakRef();
         }
     }
-    const size_t& UseCount() {
-        return use_count;
+    size_t UseCount() const {
+        if (HasSplitCount())
+            return IsBiased() ? BiasedUseCount() : ShardedUseCount();
+        size_t count = use_count.load(std::memory_order_relaxed);
+        return IsCompact() ? count & kCompactMask : count;
     }
     void IncWeakRef() {
-        ++weak_use_count;
+        if (IsCompact()) {
+            size_t count = use_count.fetch_add(kCompactWeakUnit, std::memory_order_relaxed);
+            return CheckCompactCount((count >> kCompactWeakShift) + 1);
+        }
+        WeakUseCount().fetch_add(1, std::memory_order_relaxed);
     }
     void DecWeakRef() {
-        if (--weak_use_count == 0) {
+        std::atomic<size_t>& weak_count = IsCompact() ? use_count : WeakUseCount();
+        size_t unit = IsCompact() ? kCompactWeakUnit : 1;
+        // When we hold the only reference nobody else can touch the block, so the locked
+        // RMW is skipped in the common single-owner case.
+        if (weak_count.load(std::memory_order_acquire) == unit ||
+            weak_count.fetch_sub(unit, std::memory_order_release) == unit) {
+            std::atomic_thread_fence(std::memory_order_acquire);
             DelThis();
         }
     }
 
+protected:
+    ControlBlock(const ControlBlockOps* ops_, size_t count) noexcept
+        : ops(reinterpret_cast<uintptr_t>(ops_) | (ops_->trace ? kTraceableTag : 0)),
+          use_count(count) {
+    }
+    // Blocks are never destroyed through a ControlBlock*, DelThis knows the real type.
+    ~ControlBlock() = default;
+
+    bool IsBiased() const {
+        return ops & kBiasedTag;
+    }
+    void SetBiased() {
+        ops |= kBiasedTag;
+    }
+    bool IsCompact() const {
+        return ops & kCompactTag;
+    }
+    void SetCompact() {
+        ops |= kCompactTag;
+    }
+    bool IsTraceable() const {
+        return ops & kTraceableTag;
+    }
+    void SetSharded() {
+        ops |= kShardedTag;
+    }
+    // Biased and sharded blocks keep parts of the use count outside use_count.
+    bool HasSplitCount() const {
+        return ops & (kBiasedTag | kShardedTag);
+    }
+
+    // The counting mode is kept in the lowest bits of the ops pointer, so the flags cost no
+    // space and are read from the same cache line as the counters.
+    static constexpr uintptr_t kBiasedTag = 1;
+    static constexpr uintptr_t kCompactTag = 2;
+    static constexpr uintptr_t kTraceableTag = 4;
+    static constexpr uintptr_t kShardedTag = 8;
+
+    // CompactControlBlock packs the use count into the low and the weak count into the high
+    // half of use_count.
+    static constexpr int kCompactWeakShift = 32;
+    static constexpr size_t kCompactWeakUnit = size_t(1) << kCompactWeakShift;
+    static constexpr size_t kCompactMask = kCompactWeakUnit - 1;
+    // Far below 2^32, so racing increments can't carry into the other half before one of
+    // them sees the overflow.
+    static constexpr size_t kCompactMaxCount = size_t(1) << 31;
+
+    const ControlBlockOps* Ops() const {
+        constexpr uintptr_t kTags = kBiasedTag | kCompactTag | kTraceableTag | kShardedTag;
+        return reinterpret_cast<const ControlBlockOps*>(ops & ~kTags);
+    }
+
+    uintptr_t ops;
+    std::atomic<size_t> use_count;
+
 private:
-    size_t use_count;
-    size_t weak_use_count;
+    void Trace(InstrumentedEvent event, size_t n = 1) {
+        if constexpr (kInstrumentation)
+            Instrumentation::Record(Ops()->type, event, n);
+    }
+
+    bool TryIncRef() {
+        if (HasSplitCount())
+            return IsBiased() ? IncBiasedRefIfNotZero() : IncShardedRefIfNotZero();
+        size_t mask = IsCompact() ? kCompactMask : ~size_t(0);
+        size_t count = use_count.load(std::memory_order_relaxed);
+        do {
+            if ((count & mask) == 0)
+                return false;
+        } while (!use_count.compare_exchange_weak(count, count + 1, std::memory_order_acq_rel,
+                                                  std::memory_order_relaxed));
+        if (IsCompact())
+            CheckCompactCount((count & kCompactMask) + 1);
+        return true;
+    }
+
+    // A wrapped counter would free a live object, there is no way to recover.
+    static void CheckCompactCount(size_t count) {
+        if (count > kCompactMaxCount)
+            std::abort();
+    }
+
+    void DecCompactRef(size_t n) {
+        size_t count = use_count.fetch_sub(n, std::memory_order_release);
+        if ((count & kCompactMask) != n)
+            return;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        DelObject();
+        // Both counts came from one word: with no WeakPtr left the block is unreachable and
+        // the second RMW is not needed.
+        if (count >> kCompactWeakShift == 1)
+            DelThis();
+        else
+            DecWeakRef();
+    }
+
+    std::atomic<size_t>& WeakUseCount();
+    void IncBiasedRef(size_t n);
+    bool IncBiasedRefIfNotZero();
+    void DecBiasedRef(size_t n);
+    size_t BiasedUseCount() const;
+    void IncShardedRef(size_t n);
+    bool IncShardedRefIfNotZero();
+    void DecShardedRef(size_t n);
+    size_t ShardedUseCount() const;
+};
+
+// Default layout: two full-width counters.
+class WideControlBlock : public ControlBlock {
+protected:
+    explicit WideControlBlock(const ControlBlockOps* ops_) noexcept
+        : ControlBlock(ops_, 1), weak_use_count(1) {
+    }
+    ~WideControlBlock() = default;
+
+    std::atomic<size_t> weak_use_count;
+
+    friend class ControlBlock;
+};
+
+inline std::atomic<size_t>& ControlBlock::WeakUseCount() {
+    return static_cast<WideControlBlock*>(this)->weak_use_count;
+}
+
+// Both counts in one 64-bit word, 32 bits each, which saves a word per object. Counts beyond
+// 2^31 abort the program.
+class CompactControlBlock : public ControlBlock {
+protected:
+    explicit CompactControlBlock(const ControlBlockOps* ops_) noexcept
+        : ControlBlock(ops_, kCompactWeakUnit + 1) {
+        SetCompact();
+    }
+    ~CompactControlBlock() = default;
+};
+
+// Per-thread state of biased reference counting. Other threads hand blocks back to their
+// owner through this queue when the shared part of the count drops below zero, the owner
+// merges them on its own biased decrements, on MergeBiasedRefCounts(), on the next biased
+// MakeShared and at thread exit.
+class BiasedRcOwner {
+public:
+    static BiasedRcOwner* Current() {
+        thread_local Holder holder;
+        return holder.owner;
+    }
+
+    void AddRef() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    bool Push(BiasedControlBlock* block);
+    void Merge() {
+        BiasedControlBlock* head = queue.load(std::memory_order_relaxed);
+        if (head != nullptr && head != Closed())
+            Drain(queue.exchange(nullptr, std::memory_order_acquire));
+    }
+
+private:
+    struct Holder {
+        BiasedRcOwner* owner = new BiasedRcOwner;
+        ~Holder() {
+            owner->Drain(owner->queue.exchange(Closed(), std::memory_order_acq_rel));
+            owner->Release();
+        }
+    };
+
+    BiasedRcOwner() noexcept : queue(nullptr), refs(1) {
+    }
+
+    static BiasedControlBlock* Closed() {
+        return reinterpret_cast<BiasedControlBlock*>(uintptr_t(1));
+    }
+    void Drain(BiasedControlBlock* list);
+
+    std::atomic<BiasedControlBlock*> queue;
+    std::atomic<size_t> refs;
 };
 
+// Biased reference counting: the thread that created the block keeps its own count with plain
+// loads and stores, every other thread uses the atomic use_count, which here holds a signed
+// count shifted past two flag bits. The owner merges both parts when its count reaches zero,
+// after that the block behaves like an ordinary atomic one.
+class BiasedControlBlock : public WideControlBlock {
+public:
+    explicit BiasedControlBlock(const ControlBlockOps* ops_) noexcept
+        : WideControlBlock(ops_), owner(BiasedRcOwner::Current()), biased_count(1) {
+        SetBiased();
+        use_count.store(0, std::memory_order_relaxed);
+        owner->AddRef();
+    }
+
+protected:
+    // Blocks give their owner reference back in Unbias. The biased count is only left when
+    // the constructor of the derived block throws, the owner would leak otherwise.
+    ~BiasedControlBlock() {
+        if (biased_count.load(std::memory_order_relaxed) != 0)
+            owner->Release();
+    }
+
+private:
+    static constexpr size_t kMerged = 1;
+    static constexpr size_t kQueued = 2;
+    static constexpr size_t kUnit = 4;
+
+    static std::ptrdiff_t Count(size_t word) {
+        return static_cast<std::ptrdiff_t>(word) >> 2;
+    }
+
+    bool IsOwner() const {
+        return owner == BiasedRcOwner::Current() &&
+               biased_count.load(std::memory_order_relaxed) != 0;
+    }
+
+    void IncRef(size_t n) {
+        if (IsOwner())
+            biased_count.store(biased_count.load(std::memory_order_relaxed) + n,
+                               std::memory_order_relaxed);
+        else
+            use_count.fetch_add(n * kUnit, std::memory_order_relaxed);
+    }
+
+    bool IncRefIfNotZero() {
+        if (IsOwner()) {
+            size_t count = biased_count.load(std::memory_order_relaxed);
+            if (Count(use_count.load(std::memory_order_acquire)) + std::ptrdiff_t(count) <= 0)
+                return false;
+            biased_count.store(count + 1, std::memory_order_relaxed);
+            return true;
+        }
+        // The CAS fails if the owner merges in between, so the object can't be destroyed
+        // under us while we decide.
+        size_t word = use_count.load(std::memory_order_relaxed);
+        do {
+            std::ptrdiff_t count = Count(word);
+            if (!(word & kMerged))
+                count += biased_count.load(std::memory_order_relaxed);
+            if (count <= 0)
+                return false;
+        } while (!use_count.compare_exchange_weak(word, word + kUnit, std::memory_order_acq_rel,
+                                                  std::memory_order_relaxed));
+        return true;
+    }
+
+    void DecRef(size_t n) {
+        if (IsOwner()) {
+            size_t count = biased_count.load(std::memory_order_relaxed);
+            if (count > n) {
+                biased_count.store(count - n, std::memory_order_relaxed);
+                owner->Merge();
+                return;
+            }
+            // The rest was counted on the shared side, it is merged right away.
+            if (count < n)
+                use_count.fetch_sub((n - count) * kUnit, std::memory_order_release);
+            biased_count.store(0, std::memory_order_relaxed);
+            return Unbias(0);
+        }
+        size_t word = use_count.fetch_sub(n * kUnit, std::memory_order_release) - n * kUnit;
+        if (word & kMerged) {
+            if (Count(word) == 0 && !(word & kQueued)) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                Destroy();
+            }
+        } else if (Count(word) < 0 && !(word & kQueued)) {
+            Enqueue();
+        }
+    }
+
+    size_t UseCount() const {
+        std::ptrdiff_t count = Count(use_count.load(std::memory_order_relaxed));
+        count += biased_count.load(std::memory_order_relaxed);
+        return count > 0 ? count : 0;
+    }
+
+    void Enqueue() {
+        size_t word = use_count.load(std::memory_order_relaxed);
+        while (!(word & (kMerged | kQueued))) {
+            if (use_count.compare_exchange_weak(word, word | kQueued, std::memory_order_acq_rel,
+                                                std::memory_order_relaxed)) {
+                if (!owner->Push(this))
+                    Drain();
+                return;
+            }
+        }
+    }
+
+    // Runs on the owner, or on any thread once the owner has exited.
+    void Drain() {
+        if (biased_count.load(std::memory_order_relaxed) != 0)
+            return Unbias(kQueued);
+        size_t word = use_count.fetch_sub(kQueued, std::memory_order_acq_rel) - kQueued;
+        if (Count(word) == 0)
+            Destroy();
+    }
+
+    void Unbias(size_t queued) {
+        size_t count = biased_count.load(std::memory_order_relaxed);
+        biased_count.store(0, std::memory_order_relaxed);
+        size_t delta = count * kUnit + kMerged - queued;
+        size_t word = use_count.fetch_add(delta, std::memory_order_acq_rel) + delta;
+        BiasedRcOwner* queue_owner = owner;
+        // Still queued means the owner itself dropped its last biased reference and the
+        // block waits in its own queue.
+        if (word & kQueued)
+            queue_owner->Merge();
+        else if (Count(word) == 0)
+            Destroy();
+        queue_owner->Release();
+    }
+
+    void Destroy() {
+        DelObject();
+        DecWeakRef();
+    }
+
+    BiasedRcOwner* const owner;
+    std::atomic<size_t> biased_count;
+    BiasedControlBlock* next = nullptr;
+
+    friend class ControlBlock;
+    friend class BiasedRcOwner;
+};
+
+inline void ControlBlock::IncBiasedRef(size_t n) {
+    static_cast<BiasedControlBlock*>(this)->IncRef(n);
+}
+
+inline bool ControlBlock::IncBiasedRefIfNotZero() {
+    return static_cast<BiasedControlBlock*>(this)->IncRefIfNotZero();
+}
+
+inline void ControlBlock::DecBiasedRef(size_t n) {
+    static_cast<BiasedControlBlock*>(this)->DecRef(n);
+}
+
+inline size_t ControlBlock::BiasedUseCount() const {
+    return static_cast<const BiasedControlBlock*>(this)->UseCount();
+}
+
+inline bool BiasedRcOwner::Push(BiasedControlBlock* block) {
+    BiasedControlBlock* head = queue.load(std::memory_order_acquire);
+    do {
+        if (head == Closed())
+            return false;
+        block->next = head;
+    } while (!queue.compare_exchange_weak(head, block, std::memory_order_release,
+                                          std::memory_order_acquire));
+    return true;
+}
+
+inline void BiasedRcOwner::Drain(BiasedControlBlock* list) {
+    while (list) {
+        BiasedControlBlock* next = list->next;
+        list->Drain();
+        list = next;
+    }
+}
+
+inline void MergeBiasedRefCounts() {
+    BiasedRcOwner::Current()->Merge();
+}
+
+// Sharded reference counting for the few objects that many threads copy all the time: each
+// thread counts on one of kShards cache lines, picked once per thread, instead of all of them
+// bouncing use_count. use_count holds a signed count shifted past two flag bits. A decrement
+// that finds its shard empty goes to use_count; when that drops to zero all shards are frozen
+// and folded into it, which gives the exact count: the object dies if it is zero, otherwise
+// the shards are opened again.
+class ShardedControlBlock : public WideControlBlock {
+public:
+    static constexpr size_t kShards = 16;
+
+    explicit ShardedControlBlock(const ControlBlockOps* ops_) noexcept
+        : WideControlBlock(ops_) {
+        SetSharded();
+        use_count.store(kUnit, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kFreezing = 1;
+    static constexpr size_t kDead = 2;
+    static constexpr size_t kUnit = 4;
+    // A closed shard counts nothing, increments that find it set go to use_count. They leave
+    // the bit set, it is far above any count.
+    static constexpr size_t kClosed = size_t(1) << (sizeof(size_t) * 8 - 1);
+
+    struct alignas(64) Shard {
+        std::atomic<size_t> count{0};
+    };
+
+    static std::ptrdiff_t Count(size_t word) {
+        return static_cast<std::ptrdiff_t>(word) >> 2;
+    }
+
+    static size_t ShardIndex() {
+        static std::atomic<size_t> next_index{0};
+        thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % kShards;
+        return index;
+    }
+
+    void IncRef(size_t n) {
+        size_t count = shards[ShardIndex()].count.fetch_add(n, std::memory_order_relaxed);
+        if (count & kClosed)
+            use_count.fetch_add(n * kUnit, std::memory_order_relaxed);
+    }
+
+    // Outside a freeze use_count is positive, so there is always an owner left that will
+    // decrement it when this one goes.
+    void DecRef(size_t n) {
+        std::atomic<size_t>& shard = shards[ShardIndex()].count;
+        size_t count = shard.load(std::memory_order_relaxed);
+        while (!(count & kClosed) && count >= n) {
+            if (shard.compare_exchange_weak(count, count - n, std::memory_order_release,
+                                            std::memory_order_relaxed))
+                return;
+        }
+        size_t word = use_count.fetch_sub(n * kUnit, std::memory_order_release) - n * kUnit;
+        while (Count(word) <= 0 && !(word & kFreezing)) {
+            if (use_count.compare_exchange_weak(word, word | kFreezing,
+                                                std::memory_order_acquire,
+                                                std::memory_order_relaxed))
+                return Freeze();
+        }
+    }
+
+    // Lock waits for a running freeze: use_count alone may be zero while shards still count
+    // owners.
+    bool IncRefIfNotZero() {
+        size_t word = use_count.load(std::memory_order_acquire);
+        for (;;) {
+            if (word & kFreezing) {
+                std::this_thread::yield();
+                word = use_count.load(std::memory_order_acquire);
+                continue;
+            }
+            if (word & kDead)
+                return false;
+            if (use_count.compare_exchange_weak(word, word + kUnit, std::memory_order_acq_rel,
+                                                std::memory_order_acquire))
+                return true;
+        }
+    }
+
+    size_t UseCount() const {
+        std::ptrdiff_t count = Count(use_count.load(std::memory_order_relaxed));
+        for (const Shard& shard : shards) {
+            size_t value = shard.count.load(std::memory_order_relaxed);
+            if (!(value & kClosed))
+                count += value;
+        }
+        return count > 0 ? count : 0;
+    }
+
+    // Only one thread freezes at a time, the one that set kFreezing.
+    void Freeze() {
+        for (;;) {
+            for (Shard& shard : shards) {
+                size_t count = shard.count.exchange(kClosed, std::memory_order_acq_rel);
+                if (!(count & kClosed) && count != 0)
+                    use_count.fetch_add(count * kUnit, std::memory_order_relaxed);
+            }
+            // Every count is in use_count now.
+            size_t word = use_count.load(std::memory_order_acquire);
+            if (Count(word) == 0) {
+                use_count.store(kDead, std::memory_order_release);
+                DelObject();
+                return DecWeakRef();
+            }
+            for (Shard& shard : shards)
+                shard.count.store(0, std::memory_order_release);
+            word = use_count.fetch_sub(kFreezing, std::memory_order_acq_rel) - kFreezing;
+            // Decrements that ran while the shards were closed may have used up use_count.
+            do {
+                if (Count(word) > 0 || (word & kFreezing))
+                    return;
+            } while (!use_count.compare_exchange_weak(word, word | kFreezing,
+                                                      std::memory_order_acquire,
+                                                      std::memory_order_relaxed));
+        }
+    }
+
+    Shard shards[kShards];
+
+    friend class ControlBlock;
+};
+
+// Kept out of line: once a freshly made block is inlined into the caller the compiler sees its
+// real size and warns about the sharded branch it cannot prove dead.
+[[gnu::noinline]] inline void ControlBlock::IncShardedRef(size_t n) {
+    static_cast<ShardedControlBlock*>(this)->IncRef(n);
+}
+
+[[gnu::noinline]] inline bool ControlBlock::IncShardedRefIfNotZero() {
+    return static_cast<ShardedControlBlock*>(this)->IncRefIfNotZero();
+}
+
+[[gnu::noinline]] inline void ControlBlock::DecShardedRef(size_t n) {
+    static_cast<ShardedControlBlock*>(this)->DecRef(n);
+}
+
+[[gnu::noinline]] inline size_t ControlBlock::ShardedUseCount() const {
+    return static_cast<const ShardedControlBlock*>(this)->UseCount();
+}
+
+// Specialize for types whose SharedPtr copies mostly stay on the creating thread.
 template <typename T>
-class ControlBlockPointerImp : public ControlBlock {
+struct UseBiasedRefCount : std::false_type {};
+
+// Specialize for types with many small instances, see CompactControlBlock.
+template <typename T>
+struct UseCompactRefCount : std::false_type {};
+
+template <typename T>
+using ControlBlockBase = std::conditional_t<
+    UseBiasedRefCount<T>::value, BiasedControlBlock,
+    std::conditional_t<UseCompactRefCount<T>::value, CompactControlBlock, WideControlBlock>>;
+
+// Builds the ops table of a block type from its non-virtual DelObject, DelThis, ObjectAddress
+// and, if the block declares them itself, GetDeleter and ObjectCount. Object is the type the
+// instrumentation counts the block under.
+template <typename Block, typename Object = void>
+struct ControlBlockOpsFor {
+    static void DelObject(ControlBlock* block) {
+        static_cast<Block*>(block)->DelObject();
+    }
+    static void DelThis(ControlBlock* block) {
+        static_cast<Block*>(block)->DelThis();
+    }
+    static void* ObjectAddress(ControlBlock* block) {
+        return static_cast<Block*>(block)->ObjectAddress();
+    }
+    static void* GetDeleter(ControlBlock* block, const void* id) {
+        if constexpr (std::is_same_v<decltype(&Block::GetDeleter),
+                                     void* (ControlBlock::*)(const void*)>)
+            return nullptr;
+        else
+            return static_cast<Block*>(block)->GetDeleter(id);
+    }
+    static size_t ObjectCount(ControlBlock* block) {
+        if constexpr (std::is_same_v<decltype(&Block::ObjectCount), size_t (ControlBlock::*)()>)
+            return 1;
+        else
+            return static_cast<Block*>(block)->ObjectCount();
+    }
+    static void Trace(ControlBlock* block, CycleTracer& tracer) {
+        if constexpr (HasTrace<Object>::value)
+            static_cast<Object*>(block->ObjectAddress())->Trace(tracer);
+    }
+
+    static constexpr ControlBlockOps value = {
+        &DelObject,   &DelThis, &ObjectAddress, &GetDeleter, &ObjectCount,
+        HasTrace<Object>::value ? &Trace : nullptr, InstrumentedTypeOf<Object>()};
+};
+
+template <typename T, typename Base = WideControlBlock>
+class ControlBlockPointerImp : public Base {
 public:
-    ControlBlockPointerImp(T* ptr) noexcept : ControlBlock(), object(ptr) {
+    // From the thread's ControlBlockPool, adopting raw pointers is frequent.
+    static ControlBlockPointerImp* Create(T* ptr) {
+        return new (ControlBlockPool::Allocate<sizeof(ControlBlockPointerImp)>())
+            ControlBlockPointerImp(ptr);
+    }
+
+    ControlBlockPointerImp(T* ptr) noexcept
+        : Base(&ControlBlockOpsFor<ControlBlockPointerImp, T>::value), object(ptr) {
     }
     ~ControlBlockPointerImp() = default;
 
@@ -55,18 +721,48 @@ public:
     }
 
     void DelThis() {
-        delete this;
+        this->~ControlBlockPointerImp();
+        ControlBlockPool::Deallocate<sizeof(ControlBlockPointerImp)>(this);
+    }
+
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(object));
     }
 
 private:
     T* object;
 };
 
-template <typename T>
-class ControlBlockObjectImp : public ControlBlock {
+// Selects default- instead of value-initialization in the MakeSharedForOverwrite family.
+struct ForOverwriteTag {};
+
+template <typename T, typename Base = WideControlBlock>
+class ControlBlockObjectImp : public Base {
 public:
+    static constexpr bool kOverAligned =
+        alignof(ControlBlockObjectImp) > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    static void* Allocate() {
+        if constexpr (kOverAligned)
+            return ::operator new(sizeof(ControlBlockObjectImp),
+                                  std::align_val_t(alignof(ControlBlockObjectImp)));
+        else
+            return ::operator new(sizeof(ControlBlockObjectImp));
+    }
+    static void Deallocate(void* buffer) {
+        if constexpr (kOverAligned)
+            ::operator delete(buffer, std::align_val_t(alignof(ControlBlockObjectImp)));
+        else
+            ::operator delete(buffer);
+    }
+
     template <typename... Args>
-    ControlBlockObjectImp(Args&&... args) : ControlBlock(), object(std::forward<Args>(args)...) {
+    ControlBlockObjectImp(Args&&... args)
+        : Base(&ControlBlockOpsFor<ControlBlockObjectImp, T>::value),
+          object(std::forward<Args>(args)...) {
+    }
+    explicit ControlBlockObjectImp(ForOverwriteTag)
+        : Base(&ControlBlockOpsFor<ControlBlockObjectImp, T>::value) {
     }
     ~ControlBlockObjectImp() = default;
 
@@ -81,10 +777,337 @@ public:
         object.~T();
     }
 
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(&object));
+    }
+
     void DelThis() {
-        ::operator delete(this);
+        Deallocate(this);
     }
 
 private:
     T object;
-};
\ No newline at end of file
+};
+
+// The block of an object made by MakeUniqueShareable: the allocation reserves space for it in
+// front of the object, and it is only constructed there when the UniquePtr is turned into a
+// SharedPtr.
+template <typename T, typename Base = WideControlBlock>
+class ControlBlockShareableImp : public Base {
+public:
+    static constexpr size_t Offset() {
+        return (sizeof(ControlBlockShareableImp) + alignof(T) - 1) / alignof(T) * alignof(T);
+    }
+    static void* Allocate() {
+        if constexpr (kOverAligned)
+            return ::operator new(Offset() + sizeof(T), std::align_val_t(alignof(T)));
+        else
+            return ::operator new(Offset() + sizeof(T));
+    }
+    static void Deallocate(void* buffer) {
+        if constexpr (kOverAligned)
+            ::operator delete(buffer, std::align_val_t(alignof(T)));
+        else
+            ::operator delete(buffer);
+    }
+    static void* BufferOf(T* object) {
+        return reinterpret_cast<char*>(const_cast<std::remove_cv_t<T>*>(object)) - Offset();
+    }
+
+    ControlBlockShareableImp() noexcept
+        : Base(&ControlBlockOpsFor<ControlBlockShareableImp, T>::value) {
+    }
+    ~ControlBlockShareableImp() = default;
+
+    T* GetObject() {
+        return std::launder(reinterpret_cast<T*>(reinterpret_cast<char*>(this) + Offset()));
+    }
+
+    void DelObject() {
+        GetObject()->~T();
+    }
+
+    void DelThis() {
+        Deallocate(this);
+    }
+
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(GetObject()));
+    }
+
+private:
+    static constexpr bool kOverAligned = alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+};
+
+// Header of a slab of blocks made by MakeSharedBatch, followed by the blocks.
+struct ControlBlockSlab {
+    // Blocks whose DelThis hasn't run yet, the last one frees the slab.
+    std::atomic<size_t> live;
+};
+
+// Like ControlBlockObjectImp, but one of many in a slab: DelThis only releases the block's
+// share of the slab.
+template <typename T, typename Base = WideControlBlock>
+class ControlBlockBatchImp : public Base {
+public:
+    static constexpr size_t Offset() {
+        return (sizeof(ControlBlockSlab) + alignof(ControlBlockBatchImp) - 1) /
+               alignof(ControlBlockBatchImp) * alignof(ControlBlockBatchImp);
+    }
+    static void* Allocate(size_t count) {
+        if (count > (SIZE_MAX - Offset()) / sizeof(ControlBlockBatchImp))
+            throw std::bad_array_new_length();
+        if constexpr (kOverAligned)
+            return ::operator new(Offset() + count * sizeof(ControlBlockBatchImp),
+                                  std::align_val_t(alignof(ControlBlockBatchImp)));
+        else
+            return ::operator new(Offset() + count * sizeof(ControlBlockBatchImp));
+    }
+    static void Deallocate(void* buffer) {
+        if constexpr (kOverAligned)
+            ::operator delete(buffer, std::align_val_t(alignof(ControlBlockBatchImp)));
+        else
+            ::operator delete(buffer);
+    }
+    static ControlBlockBatchImp* Blocks(ControlBlockSlab* slab) {
+        return reinterpret_cast<ControlBlockBatchImp*>(reinterpret_cast<char*>(slab) + Offset());
+    }
+
+    // The object is initialized from make(index), a prvalue T is constructed in place.
+    template <typename Make>
+    ControlBlockBatchImp(ControlBlockSlab* slab_, Make& make, size_t index)
+        : Base(&ControlBlockOpsFor<ControlBlockBatchImp, T>::value), slab(slab_),
+          object(make(index)) {
+    }
+    ~ControlBlockBatchImp() = default;
+
+    T* GetObject() {
+        return &object;
+    }
+
+    void DelObject() {
+        object.~T();
+    }
+
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(&object));
+    }
+
+    // Like ControlBlockObjectImp::DelThis, the destructor is not run again: DelObject has
+    // already destroyed the object.
+    void DelThis() {
+        if (slab->live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            Deallocate(slab);
+    }
+
+private:
+    static constexpr bool kOverAligned =
+        alignof(ControlBlockBatchImp) > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    ControlBlockSlab* slab;
+    T object;
+};
+
+// Block, element count and elements in one allocation, the elements follow the block.
+template <typename T, typename Base = WideControlBlock>
+class ControlBlockArrayImp : public Base {
+public:
+    static void* Allocate(size_t count) {
+        if (count > (SIZE_MAX - Offset()) / sizeof(T))
+            throw std::bad_array_new_length();
+        if constexpr (kOverAligned)
+            return ::operator new(Offset() + count * sizeof(T), std::align_val_t(alignof(T)));
+        else
+            return ::operator new(Offset() + count * sizeof(T));
+    }
+    static void Deallocate(void* buffer) {
+        if constexpr (kOverAligned)
+            ::operator delete(buffer, std::align_val_t(alignof(T)));
+        else
+            ::operator delete(buffer);
+    }
+
+    // Elements constructed so far are destroyed if one of the constructors throws.
+    ControlBlockArrayImp(size_t count_, bool value_init)
+        : Base(&ControlBlockOpsFor<ControlBlockArrayImp, T>::value), count(0) {
+        Element* elements = GetObject();
+        try {
+            for (; count < count_; ++count) {
+                if (value_init)
+                    ::new (static_cast<void*>(elements + count)) Element();
+                else
+                    ::new (static_cast<void*>(elements + count)) Element;
+            }
+        } catch (...) {
+            DelObject();
+            throw;
+        }
+    }
+    ~ControlBlockArrayImp() = default;
+
+    T* GetObject() {
+        return std::launder(reinterpret_cast<Element*>(reinterpret_cast<char*>(this) + Offset()));
+    }
+
+    void DelObject() {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            Element* elements = GetObject();
+            while (count > 0)
+                elements[--count].~Element();
+        }
+    }
+
+    void DelThis() {
+        Deallocate(this);
+    }
+
+    void* ObjectAddress() {
+        return GetObject();
+    }
+    size_t ObjectCount() {
+        return count;
+    }
+
+private:
+    static_assert(!std::is_array_v<T>, "only one-dimensional arrays are supported");
+
+    using Element = std::remove_cv_t<T>;
+
+    static constexpr bool kOverAligned = alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    static constexpr size_t Offset() {
+        return (sizeof(ControlBlockArrayImp) + alignof(T) - 1) / alignof(T) * alignof(T);
+    }
+
+    size_t count;
+};
+
+template <typename T, typename Alloc, typename Base = WideControlBlock>
+class ControlBlockPointerAllocImp : public Base {
+public:
+    ControlBlockPointerAllocImp(T* ptr, const Alloc& alloc) noexcept
+        : Base(&ControlBlockOpsFor<ControlBlockPointerAllocImp, T>::value), data(ptr, alloc) {
+    }
+    ~ControlBlockPointerAllocImp() = default;
+
+    void DelObject() {
+        if (data.GetFirst())
+            delete data.GetFirst();
+
+        data.GetFirst() = nullptr;
+    }
+
+    void DelThis() {
+        using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<
+            ControlBlockPointerAllocImp>;
+        BlockAlloc alloc(data.GetSecond());
+        this->~ControlBlockPointerAllocImp();
+        std::allocator_traits<BlockAlloc>::deallocate(alloc, this, 1);
+    }
+
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(data.GetFirst()));
+    }
+
+private:
+    // A stateless allocator takes no space thanks to EBO.
+    CompressedPair<T*, Alloc> data;
+};
+
+template <typename T, typename Alloc, typename Base = WideControlBlock>
+class ControlBlockObjectAllocImp : public Base {
+public:
+    template <typename... Args>
+    ControlBlockObjectAllocImp(const Alloc& alloc, Args&&... args)
+        : Base(&ControlBlockOpsFor<ControlBlockObjectAllocImp, T>::value), data(alloc, Storage()) {
+        ObjectAlloc object_alloc(data.GetFirst());
+        std::allocator_traits<ObjectAlloc>::construct(object_alloc, GetObject(),
+                                                      std::forward<Args>(args)...);
+    }
+    ~ControlBlockObjectAllocImp() = default;
+
+    std::remove_cv_t<T>* GetObject() {
+        return std::launder(reinterpret_cast<std::remove_cv_t<T>*>(&data.GetSecond()));
+    }
+
+    void DelObject() {
+        ObjectAlloc object_alloc(data.GetFirst());
+        std::allocator_traits<ObjectAlloc>::destroy(object_alloc, GetObject());
+    }
+
+    void DelThis() {
+        using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<
+            ControlBlockObjectAllocImp>;
+        BlockAlloc alloc(data.GetFirst());
+        this->~ControlBlockObjectAllocImp();
+        std::allocator_traits<BlockAlloc>::deallocate(alloc, this, 1);
+    }
+
+    void* ObjectAddress() {
+        return GetObject();
+    }
+
+private:
+    using ObjectAlloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<std::remove_cv_t<T>>;
+
+    struct alignas(T) Storage {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    // The object is constructed and destroyed through the allocator, so it lives in raw
+    // storage next to it.
+    CompressedPair<Alloc, Storage> data;
+};
+
+template <typename T, typename Deleter, typename Alloc, typename Base = WideControlBlock>
+class ControlBlockPointerDeleterImp : public Base {
+public:
+    ControlBlockPointerDeleterImp(T* ptr, Deleter&& deleter, const Alloc& alloc) noexcept
+        : Base(&ControlBlockOpsFor<ControlBlockPointerDeleterImp, T>::value),
+          data(ptr, CompressedPair<Deleter, Alloc>(std::move(deleter), alloc)) {
+    }
+    ~ControlBlockPointerDeleterImp() = default;
+
+    void DelObject() {
+        data.GetSecond().GetFirst()(data.GetFirst());
+        data.GetFirst() = nullptr;
+    }
+
+    void DelThis() {
+        using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<
+            ControlBlockPointerDeleterImp>;
+        BlockAlloc alloc(data.GetSecond().GetSecond());
+        this->~ControlBlockPointerDeleterImp();
+        std::allocator_traits<BlockAlloc>::deallocate(alloc, this, 1);
+    }
+
+    void* ObjectAddress() {
+        return const_cast<void*>(static_cast<const void*>(data.GetFirst()));
+    }
+
+    void* GetDeleter(const void* id) {
+        if (id != &DeleterId<Deleter>::id)
+            return nullptr;
+        return &data.GetSecond().GetFirst();
+    }
+
+private:
+    // Stateless deleters and allocators take no space thanks to EBO.
+    CompressedPair<T*, CompressedPair<Deleter, Alloc>> data;
+};
+
+// Bytes saved per object by MakeSharedCompact or UseCompactRefCount<T>.
+template <typename T>
+constexpr size_t CompactRefCountSaving() {
+    return sizeof(ControlBlockObjectImp<T, WideControlBlock>) -
+           sizeof(ControlBlockObjectImp<T, CompactControlBlock>);
+}
+
+static_assert(sizeof(size_t) == 8);
+static_assert(sizeof(WideControlBlock) == 3 * sizeof(void*));
+static_assert(sizeof(CompactControlBlock) == 2 * sizeof(void*));
+static_assert(sizeof(ControlBlockPointerImp<int>) == 4 * sizeof(void*));
+static_assert(sizeof(ControlBlockObjectImp<int>) == 4 * sizeof(void*));
+static_assert(sizeof(ControlBlockObjectImp<void*>) == 4 * sizeof(void*));
+static_assert(CompactRefCountSaving<int>() == sizeof(void*));
\ No newline at end of file
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Totals of ControlBlockPool over all threads, see ControlBlockPool::Collect.
+struct ControlBlockPoolStats {
+    // Allocations served by the thread's cache or by a batch from the depot.
+    uint64_t hits = 0;
+    // Allocations that went to operator new.
+    uint64_t misses = 0;
+    // Batches taken from the depot, mostly blocks released by other threads.
+    uint64_t transfers = 0;
+
+    double HitRate() const {
+        return hits + misses == 0 ? 0.0 : double(hits) / double(hits + misses);
+    }
+};
+
+// Size-classed free lists for control blocks, which are all a few words long and churn as
+// fast as raw pointers are adopted. Blocks are freed into the cache of the freeing thread, so
+// the common case takes no lock and no atomic read-modify-write. A cache that fills up moves
+// half of a class to a shared depot of bounded size, where threads that allocate more than
+// they free pick up whole batches; this is how blocks released on another thread than the one
+// that allocated them find their way back. Blocks beyond the bound go back to the heap.
+class ControlBlockPool {
+public:
+    static constexpr size_t kGranularity = 16;
+    static constexpr size_t kClasses = 4;
+    static constexpr size_t kMaxSize = kGranularity * kClasses;
+    // Blocks per thread and class.
+    static constexpr size_t kCacheLimit = 256;
+    static constexpr size_t kBatch = kCacheLimit / 2;
+    // Batches per class in the depot, it holds at most kDepotBatches * kBatch blocks of a class.
+    static constexpr size_t kDepotBatches = 256;
+
+    template <size_t Size>
+    static void* Allocate() {
+        static_assert(Size <= kMaxSize);
+        constexpr size_t index = ClassOf(Size);
+        if (exited)
+            return ::operator new(ClassSize(index));
+        Cache& cache = Local();
+        FreeBlock* block = cache.heads[index];
+        if (!block)
+            return cache.Refill(index);
+        cache.heads[index] = block->next;
+        --cache.counts[index];
+        Bump(cache.hits);
+        return block;
+    }
+
+    template <size_t Size>
+    static void Deallocate(void* ptr) {
+        static_assert(Size <= kMaxSize);
+        constexpr size_t index = ClassOf(Size);
+        if (exited)
+            return ::operator delete(ptr);
+        Cache& cache = Local();
+        if (cache.counts[index] == kCacheLimit && !cache.Spill(index))
+            return ::operator delete(ptr);
+        FreeBlock* block = static_cast<FreeBlock*>(ptr);
+        block->next = cache.heads[index];
+        cache.heads[index] = block;
+        ++cache.counts[index];
+    }
+
+    static ControlBlockPoolStats Collect() {
+        std::lock_guard<std::mutex> lock(Registry().mutex);
+        ControlBlockPoolStats stats = Registry().retired;
+        for (Cache* cache : Registry().threads)
+            cache->AddTo(&stats);
+        stats.transfers = Registry().transfers.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    static void Dump(FILE* out) {
+        ControlBlockPoolStats stats = Collect();
+        std::fprintf(out, "control block pool: %llu hits, %llu misses (%.1f%% hits), %llu "
+                          "batches from the depot\n",
+                     (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                     100 * stats.HitRate(), (unsigned long long)stats.transfers);
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static constexpr size_t ClassOf(size_t size) {
+        return size == 0 ? 0 : (size - 1) / kGranularity;
+    }
+    static constexpr size_t ClassSize(size_t index) {
+        return (index + 1) * kGranularity;
+    }
+
+    // Written only by the owning thread, Collect reads them concurrently.
+    static void Bump(std::atomic<uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    struct Cache {
+        Cache() {
+            std::lock_guard<std::mutex> lock(Registry().mutex);
+            Registry().threads.push_back(this);
+        }
+
+        // Whatever is cached goes to the depot for the threads that stay.
+        ~Cache() {
+            for (size_t index = 0; index < kClasses; ++index) {
+                while (counts[index] > 0 && Spill(index)) {
+                }
+                for (FreeBlock* block = heads[index]; block;) {
+                    FreeBlock* next = block->next;
+                    ::operator delete(block);
+                    block = next;
+                }
+            }
+            std::lock_guard<std::mutex> lock(Registry().mutex);
+            AddTo(&Registry().retired);
+            auto& threads = Registry().threads;
+            threads.erase(std::find(threads.begin(), threads.end(), this));
+            exited = true;
+        }
+
+        void* Refill(size_t index) {
+            FreeBlock* batch = nullptr;
+            {
+                Depot& depot = Registry().depots[index];
+                std::lock_guard<std::mutex> lock(depot.mutex);
+                if (!depot.batches.empty()) {
+                    batch = depot.batches.back().head;
+                    counts[index] = depot.batches.back().count - 1;
+                    depot.batches.pop_back();
+                    depot.size.store(depot.batches.size(), std::memory_order_relaxed);
+                }
+            }
+            if (!batch) {
+                Bump(misses);
+                return ::operator new(ClassSize(index));
+            }
+            Bump(hits);
+            Registry().transfers.fetch_add(1, std::memory_order_relaxed);
+            heads[index] = batch->next;
+            return batch;
+        }
+
+        // Moves up to kBatch blocks to the depot. False if it is full, the caller frees to the
+        // heap instead.
+        bool Spill(size_t index) {
+            Depot& depot = Registry().depots[index];
+            if (depot.size.load(std::memory_order_relaxed) >= kDepotBatches)
+                return false;
+            Batch batch{heads[index], 0};
+            FreeBlock* last = batch.head;
+            for (batch.count = 1; batch.count < std::min(kBatch, counts[index]); ++batch.count)
+                last = last->next;
+            std::lock_guard<std::mutex> lock(depot.mutex);
+            if (depot.batches.size() >= kDepotBatches)
+                return false;
+            heads[index] = last->next;
+            last->next = nullptr;
+            counts[index] -= batch.count;
+            depot.batches.push_back(batch);
+            depot.size.store(depot.batches.size(), std::memory_order_relaxed);
+            return true;
+        }
+
+        void AddTo(ControlBlockPoolStats* stats) const {
+            stats->hits += hits.load(std::memory_order_relaxed);
+            stats->misses += misses.load(std::memory_order_relaxed);
+        }
+
+        FreeBlock* heads[kClasses] = {};
+        size_t counts[kClasses] = {};
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+
+    struct Batch {
+        FreeBlock* head;
+        size_t count;
+    };
+
+    struct Depot {
+        std::mutex mutex;
+        std::vector<Batch> batches;
+        // batches.size(), so a full depot can be seen without the lock.
+        std::atomic<size_t> size{0};
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::vector<Cache*> threads;
+        // Counts of exited threads.
+        ControlBlockPoolStats retired;
+        std::atomic<uint64_t> transfers{0};
+        Depot depots[kClasses];
+    };
+
+    // Never destroyed: caches of threads that exit late still return their blocks.
+    static State& Registry() {
+        static State* state = new State();
+        return *state;
+    }
+
+    static Cache& Local() {
+        thread_local Cache cache;
+        return cache;
+    }
+
+    // Set once the cache of this thread is gone, later thread-local destructors use the heap.
+    static inline thread_local bool exited = false;
+};
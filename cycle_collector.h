@@ -0,0 +1,387 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "shared_ptr.h"
+
+class CycleCollector;
+
+// Passed to T::Trace, which has to call it on every CollectableSharedPtr member of T.
+class CycleTracer {
+public:
+    template <typename U>
+    void operator()(CollectableSharedPtr<U>& ptr);
+
+private:
+    explicit CycleTracer(CycleCollector& collector_, bool clear_)
+        : collector(collector_), clear(clear_) {
+    }
+
+    CycleCollector& collector;
+    // Set while garbage is freed: members are reset instead of visited.
+    bool clear;
+
+    friend class CycleCollector;
+};
+
+// Finds SharedPtr cycles with trial deletion (Bacon and Rajan). Objects with a Trace method
+// that lose a reference but stay alive are buffered as candidate roots by ControlBlock::DecRef.
+// A collection snapshots the use counts of the graph below the candidates, subtracts the
+// references coming from inside that graph and frees what is left without external references.
+// It runs in slices of bounded work.
+//
+// One collector per thread, and a collectable graph must only be touched by the thread that
+// collects it. References released on threads without a collector are not buffered. Changes
+// between slices are detected and restart the collection; the weak references the
+// collection holds keep the blocks it has seen readable until then.
+class CycleCollector {
+public:
+    static constexpr size_t kDefaultBudget = 1024;
+
+    static CycleCollector& Local() {
+        thread_local CycleCollector collector;
+        return collector;
+    }
+
+    CycleCollector(const CycleCollector&) = delete;
+    CycleCollector& operator=(const CycleCollector&) = delete;
+
+    // Thread-local destructors that run later release their collectables untracked.
+    ~CycleCollector() {
+        CollectAll();
+        exited = true;
+        cycle_candidate_hook = nullptr;
+        for (ControlBlock* block : candidates)
+            block->DecWeakRef();
+    }
+
+    // Does at most about budget objects and edges of work. Returns true when the collection
+    // has finished and no candidates are left.
+    bool Collect(size_t budget = kDefaultBudget) {
+        while (budget > 0) {
+            switch (phase) {
+                case Phase::kIdle:
+                    if (candidates.empty())
+                        return true;
+                    Start();
+                    break;
+                case Phase::kMark:
+                    if (epoch != start_epoch)
+                        Restart();
+                    else
+                        Mark(budget);
+                    break;
+                case Phase::kScan:
+                    if (epoch != start_epoch)
+                        Restart();
+                    else
+                        Scan(budget);
+                    break;
+                case Phase::kCollect:
+                    Finish();
+                    break;
+            }
+        }
+        return phase == Phase::kIdle && candidates.empty();
+    }
+
+    void CollectAll() {
+        while (!Collect()) {
+        }
+    }
+
+    size_t CandidateCount() const {
+        return candidates.size() + roots.size();
+    }
+    // Objects freed by the collector so far.
+    size_t CollectedCount() const {
+        return collected;
+    }
+
+private:
+    struct Node {
+        // Use count at the time the node was found, the collection is void if it changes.
+        size_t use_count;
+        // What remains after the references from inside the graph are subtracted.
+        size_t external;
+        bool reachable;
+    };
+
+    enum class Phase { kIdle, kMark, kScan, kCollect };
+
+    CycleCollector() {
+        cycle_candidate_hook = &AddCandidate;
+    }
+
+    // Every mutation of a CollectableSharedPtr, so a collection can tell that the graph it
+    // has seen is outdated.
+    static void Touch() {
+        if (!exited)
+            ++Local().epoch;
+    }
+
+    // Called before a reference that does not drop the count to zero is released, only on
+    // threads whose collector exists. The weak reference keeps the block readable while it is
+    // buffered.
+    static void AddCandidate(ControlBlock* block) {
+        CycleCollector& collector = Local();
+        if (!collector.buffered.insert(block).second)
+            return;
+        block->IncWeakRef();
+        collector.candidates.push_back(block);
+    }
+
+    void Start() {
+        roots.swap(candidates);
+        buffered.clear();
+        start_epoch = epoch;
+        for (ControlBlock* root : roots) {
+            if (root->UseCount() != 0 && nodes.count(root) == 0)
+                AddNode(root);
+        }
+        phase = Phase::kMark;
+    }
+
+    // The weak reference is dropped by Reset or Restart: an object the mutator frees between
+    // slices leaves a readable block whose use count is zero.
+    void AddNode(ControlBlock* block) {
+        block->IncWeakRef();
+        size_t use_count = block->UseCount();
+        nodes.emplace(block, Node{use_count, use_count, false});
+        order.push_back(block);
+        work.push_back(block);
+    }
+
+    // Walks everything reachable from the roots and subtracts each internal edge.
+    void Mark(size_t& budget) {
+        while (budget > 0 && !work.empty()) {
+            ControlBlock* block = work.back();
+            work.pop_back();
+            if (block->UseCount() != 0) {
+                CycleTracer tracer(*this, false);
+                block->TraceObject(tracer);
+            }
+            --budget;
+        }
+        if (work.empty()) {
+            phase = Phase::kScan;
+            cursor = 0;
+        }
+    }
+
+    void Visit(ControlBlock* block) {
+        if (phase == Phase::kMark) {
+            auto it = nodes.find(block);
+            if (it == nodes.end()) {
+                AddNode(block);
+                it = nodes.find(block);
+            }
+            --it->second.external;
+        } else {
+            Node& node = nodes.at(block);
+            if (!node.reachable) {
+                node.reachable = true;
+                work.push_back(block);
+            }
+        }
+    }
+
+    // Everything with references from outside the graph, and everything below it, is alive.
+    void Scan(size_t& budget) {
+        while (budget > 0) {
+            if (!work.empty()) {
+                ControlBlock* block = work.back();
+                work.pop_back();
+                if (block->UseCount() != 0) {
+                    CycleTracer tracer(*this, false);
+                    block->TraceObject(tracer);
+                }
+            } else if (cursor < order.size()) {
+                Node& node = nodes.at(order[cursor++]);
+                if (node.external > 0 && !node.reachable) {
+                    node.reachable = true;
+                    work.push_back(order[cursor - 1]);
+                }
+            } else {
+                phase = Phase::kCollect;
+                return;
+            }
+            --budget;
+        }
+    }
+
+    void Finish() {
+        std::vector<ControlBlock*> garbage;
+        bool valid = epoch == start_epoch;
+        for (ControlBlock* block : order) {
+            const Node& node = nodes.at(block);
+            if (node.reachable)
+                continue;
+            valid = valid && block->UseCount() == node.use_count;
+            garbage.push_back(block);
+        }
+        if (!valid) {
+            Restart();
+            return;
+        }
+        // Our own references keep the objects alive while their edges are cut, so every
+        // destructor runs on an object with all collectable members already empty.
+        for (ControlBlock* block : garbage)
+            block->IncRef();
+        for (ControlBlock* block : garbage) {
+            CycleTracer tracer(*this, true);
+            block->TraceObject(tracer);
+        }
+        for (ControlBlock* block : garbage)
+            block->DecRef();
+        collected += garbage.size();
+        Reset();
+    }
+
+    // The graph changed between slices: the roots go back to the candidates.
+    void Restart() {
+        for (ControlBlock* root : roots) {
+            if (root->UseCount() != 0 && buffered.insert(root).second)
+                candidates.push_back(root);
+            else
+                root->DecWeakRef();
+        }
+        roots.clear();
+        ClearGraph();
+    }
+
+    void Reset() {
+        for (ControlBlock* root : roots)
+            root->DecWeakRef();
+        roots.clear();
+        ClearGraph();
+    }
+
+    void ClearGraph() {
+        for (ControlBlock* block : order)
+            block->DecWeakRef();
+        nodes.clear();
+        order.clear();
+        work.clear();
+        phase = Phase::kIdle;
+    }
+
+    // Set once the collector of this thread is destroyed.
+    static inline thread_local bool exited = false;
+
+    std::vector<ControlBlock*> candidates;
+    std::unordered_set<ControlBlock*> buffered;
+    std::vector<ControlBlock*> roots;
+
+    Phase phase = Phase::kIdle;
+    std::unordered_map<ControlBlock*, Node> nodes;
+    // Nodes in the order they were found, the scan walks it with cursor.
+    std::vector<ControlBlock*> order;
+    std::vector<ControlBlock*> work;
+    size_t cursor = 0;
+
+    size_t epoch = 0;
+    size_t start_epoch = 0;
+    size_t collected = 0;
+
+    friend class CycleTracer;
+    template <typename U>
+    friend class CollectableSharedPtr;
+};
+
+// A SharedPtr for the edges of object graphs that may form cycles. T exposes these members
+// through void Trace(CycleTracer&); types without Trace are leaves. Plain SharedPtrs to
+// collectable objects are fine outside the graph, they count as external references. Edges
+// have to be CollectableSharedPtrs, so a collection notices when they move.
+template <typename T>
+class CollectableSharedPtr {
+public:
+    CollectableSharedPtr() noexcept = default;
+    CollectableSharedPtr(std::nullptr_t) noexcept {
+    }
+    CollectableSharedPtr(SharedPtr<T> ptr_) noexcept : ptr(std::move(ptr_)) {
+        CycleCollector::Touch();
+    }
+    CollectableSharedPtr(const CollectableSharedPtr& other) noexcept : ptr(other.ptr) {
+        CycleCollector::Touch();
+    }
+    CollectableSharedPtr(CollectableSharedPtr&& other) noexcept : ptr(std::move(other.ptr)) {
+        CycleCollector::Touch();
+    }
+
+    CollectableSharedPtr& operator=(const CollectableSharedPtr& other) {
+        CollectableSharedPtr(other).Swap(*this);
+        return *this;
+    }
+    CollectableSharedPtr& operator=(CollectableSharedPtr&& other) {
+        CollectableSharedPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ~CollectableSharedPtr() {
+        Release();
+    }
+
+    void Reset() {
+        Release();
+        ptr.Reset();
+    }
+    void Swap(CollectableSharedPtr& other) {
+        CycleCollector::Touch();
+        ptr.Swap(other.ptr);
+    }
+
+    T* Get() const {
+        return ptr.Get();
+    }
+    T& operator*() const {
+        return *Get();
+    }
+    T* operator->() const {
+        return Get();
+    }
+    size_t UseCount() const {
+        return ptr.UseCount();
+    }
+    explicit operator bool() const {
+        return Get() != nullptr;
+    }
+    const SharedPtr<T>& Shared() const {
+        return ptr;
+    }
+
+private:
+    ControlBlock* Block() const {
+        return ptr.block;
+    }
+
+    void Release() {
+        if (ptr.block)
+            CycleCollector::Touch();
+    }
+
+    SharedPtr<T> ptr;
+
+    friend class CycleTracer;
+};
+
+// While garbage is freed the members are reset as usual, so surviving children become
+// candidates for the next collection.
+template <typename U>
+void CycleTracer::operator()(CollectableSharedPtr<U>& ptr) {
+    if (clear)
+        return ptr.Reset();
+    if constexpr (HasTrace<U>::value) {
+        if (ControlBlock* block = ptr.Block())
+            collector.Visit(block);
+    }
+}
+
+template <typename T, typename... Args>
+CollectableSharedPtr<T> MakeCollectable(Args&&... args) {
+    return CollectableSharedPtr<T>(MakeShared<T>(std::forward<Args>(args)...));
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Per-type counters of allocations and reference count traffic. Compile with
+// SMART_PTRS_INSTRUMENT defined to enable them, otherwise every hook is an empty inline
+// function and the type descriptors are never instantiated.
+#ifdef SMART_PTRS_INSTRUMENT
+inline constexpr bool kInstrumentation = true;
+#else
+inline constexpr bool kInstrumentation = false;
+#endif
+
+// Type names without RTTI, taken from the signature of this function.
+template <typename T>
+constexpr std::string_view TypeName() {
+#if defined(__clang__) || defined(__GNUC__)
+    std::string_view name = __PRETTY_FUNCTION__;
+    size_t begin = name.find("T = ") + 4;
+    size_t end = name.find_first_of(";]", begin);
+    return name.substr(begin, end - begin);
+#elif defined(_MSC_VER)
+    std::string_view name = __FUNCSIG__;
+    size_t begin = name.find("TypeName<") + 9;
+    size_t end = name.rfind(">(");
+    return name.substr(begin, end - begin);
+#else
+    return "unknown";
+#endif
+}
+
+// One static descriptor per instrumented type. Live bytes and their peak are kept here, the
+// event counters live in thread-local storage.
+struct InstrumentedType {
+    constexpr InstrumentedType(std::string_view name_, size_t size_)
+        : name(name_), size(size_), id(-1), live_bytes(0), peak_bytes(0) {
+    }
+
+    std::string_view name;
+    size_t size;
+    std::atomic<int> id;
+    std::atomic<int64_t> live_bytes;
+    std::atomic<int64_t> peak_bytes;
+};
+
+template <typename T>
+inline InstrumentedType instrumented_type{TypeName<T>(), sizeof(T)};
+
+// nullptr when instrumentation is off (or for void), so hooks can be passed the result
+// unconditionally.
+template <typename T>
+constexpr InstrumentedType* InstrumentedTypeOf() {
+    if constexpr (kInstrumentation && !std::is_void_v<T>)
+        return &instrumented_type<T>;
+    else
+        return nullptr;
+}
+
+enum class InstrumentedEvent {
+    kAllocate,
+    kFree,
+    kIncRef,
+    kDecRef,
+    kLockHit,
+    kLockMiss,
+};
+
+// Totals of one type over all threads, see Instrumentation::Collect.
+struct InstrumentationReport {
+    std::string name;
+    size_t object_size = 0;
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t inc_refs = 0;
+    uint64_t dec_refs = 0;
+    uint64_t lock_hits = 0;
+    uint64_t lock_misses = 0;
+    int64_t live_bytes = 0;
+    int64_t peak_live_bytes = 0;
+
+    int64_t LiveObjects() const {
+        return static_cast<int64_t>(allocations - frees);
+    }
+    uint64_t RefTraffic() const {
+        return inc_refs + dec_refs;
+    }
+};
+
+class Instrumentation {
+public:
+    static constexpr int kMaxTypes = 512;
+    static constexpr size_t kEventCount = 6;
+    // Live bytes are counted per thread and published to the type once they drift this far,
+    // so the peak is exact up to this many bytes per thread.
+    static constexpr int64_t kFlushBytes = 64 * 1024;
+
+    static void Record(InstrumentedType* type, InstrumentedEvent event, size_t count = 1) {
+        if constexpr (kInstrumentation) {
+            uint32_t sample_period = period.load(std::memory_order_relaxed);
+            if (!type || exited || !Sampled(event, sample_period))
+                return;
+            Local()->Add(type, event, count * sample_period);
+        }
+    }
+
+    // Records each event with probability 1 / period, scaled by period, so the totals stay
+    // estimates of the real numbers. 1 records everything.
+    static void SetSamplePeriod(uint32_t period_) {
+        period.store(std::max<uint32_t>(period_, 1), std::memory_order_relaxed);
+    }
+
+    static std::vector<InstrumentationReport> Collect() {
+        std::vector<InstrumentationReport> result;
+        std::lock_guard<std::mutex> lock(Registry().mutex);
+        std::vector<uint64_t> totals = Registry().retired;
+        for (ThreadCounters* counters : Registry().threads)
+            counters->AddTo(&totals);
+        for (InstrumentedType* type : Registry().types) {
+            int id = type->id.load(std::memory_order_relaxed);
+            const uint64_t* counts = &totals[id * kEventCount];
+            InstrumentationReport report;
+            report.name = std::string(type->name);
+            report.object_size = type->size;
+            report.allocations = counts[size_t(InstrumentedEvent::kAllocate)];
+            report.frees = counts[size_t(InstrumentedEvent::kFree)];
+            report.inc_refs = counts[size_t(InstrumentedEvent::kIncRef)];
+            report.dec_refs = counts[size_t(InstrumentedEvent::kDecRef)];
+            report.lock_hits = counts[size_t(InstrumentedEvent::kLockHit)];
+            report.lock_misses = counts[size_t(InstrumentedEvent::kLockMiss)];
+            report.live_bytes = report.LiveObjects() * static_cast<int64_t>(type->size);
+            report.peak_live_bytes = std::max(type->peak_bytes.load(std::memory_order_relaxed),
+                                              report.live_bytes);
+            result.push_back(report);
+        }
+        return result;
+    }
+
+    // Prints the top types by reference count traffic, then allocations.
+    static void Dump(FILE* out = stdout, size_t top = 10) {
+        std::vector<InstrumentationReport> reports = Collect();
+        std::sort(reports.begin(), reports.end(), [](const auto& left, const auto& right) {
+            if (left.RefTraffic() != right.RefTraffic())
+                return left.RefTraffic() > right.RefTraffic();
+            return left.allocations > right.allocations;
+        });
+        if (reports.size() > top)
+            reports.resize(top);
+        std::fprintf(out, "%-40s %10s %10s %12s %12s %10s %10s %12s\n", "type", "allocs", "live",
+                     "inc_ref", "dec_ref", "lock_hit", "lock_miss", "peak_bytes");
+        for (const InstrumentationReport& report : reports) {
+            std::fprintf(out, "%-40.40s %10llu %10lld %12llu %12llu %10llu %10llu %12lld\n",
+                         report.name.c_str(), (unsigned long long)report.allocations,
+                         (long long)report.LiveObjects(), (unsigned long long)report.inc_refs,
+                         (unsigned long long)report.dec_refs, (unsigned long long)report.lock_hits,
+                         (unsigned long long)report.lock_misses,
+                         (long long)report.peak_live_bytes);
+        }
+    }
+
+private:
+    // Written only by its thread with plain load/store pairs, Collect reads it concurrently.
+    struct ThreadCounters {
+        std::atomic<uint64_t> counts[kMaxTypes * kEventCount] = {};
+        int64_t pending_bytes[kMaxTypes] = {};
+
+        void Add(InstrumentedType* type, InstrumentedEvent event, uint64_t weight) {
+            int id = Id(type);
+            if (id < 0)
+                return;
+            std::atomic<uint64_t>& count = counts[id * kEventCount + size_t(event)];
+            count.store(count.load(std::memory_order_relaxed) + weight, std::memory_order_relaxed);
+            if (event == InstrumentedEvent::kAllocate)
+                Move(type, id, static_cast<int64_t>(weight * type->size));
+            else if (event == InstrumentedEvent::kFree)
+                Move(type, id, -static_cast<int64_t>(weight * type->size));
+        }
+
+        void Move(InstrumentedType* type, int id, int64_t bytes) {
+            pending_bytes[id] += bytes;
+            if (pending_bytes[id] < kFlushBytes && pending_bytes[id] > -kFlushBytes)
+                return;
+            Flush(type, id);
+        }
+
+        void Flush(InstrumentedType* type, int id) {
+            int64_t bytes = pending_bytes[id];
+            int64_t live = type->live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+            pending_bytes[id] = 0;
+            int64_t peak = type->peak_bytes.load(std::memory_order_relaxed);
+            while (live > peak && !type->peak_bytes.compare_exchange_weak(
+                                      peak, live, std::memory_order_relaxed))
+                ;
+        }
+
+        void AddTo(std::vector<uint64_t>* totals) const {
+            for (size_t i = 0; i < totals->size(); ++i)
+                (*totals)[i] += counts[i].load(std::memory_order_relaxed);
+        }
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::vector<InstrumentedType*> types;
+        std::vector<ThreadCounters*> threads;
+        // Counts of exited threads.
+        std::vector<uint64_t> retired = std::vector<uint64_t>(kMaxTypes * kEventCount);
+    };
+
+    static State& Registry() {
+        static State* state = new State();
+        return *state;
+    }
+
+    static int Id(InstrumentedType* type) {
+        int id = type->id.load(std::memory_order_acquire);
+        if (id >= 0 || id == kUnregistered)
+            return id;
+        std::lock_guard<std::mutex> lock(Registry().mutex);
+        id = type->id.load(std::memory_order_relaxed);
+        if (id == -1) {
+            id = Registry().types.size() < size_t(kMaxTypes) ? int(Registry().types.size())
+                                                             : kUnregistered;
+            if (id >= 0)
+                Registry().types.push_back(type);
+            type->id.store(id, std::memory_order_release);
+        }
+        return id;
+    }
+
+    struct Holder {
+        Holder() : counters(new ThreadCounters()) {
+            std::lock_guard<std::mutex> lock(Registry().mutex);
+            Registry().threads.push_back(counters);
+        }
+        ~Holder() {
+            std::lock_guard<std::mutex> lock(Registry().mutex);
+            counters->AddTo(&Registry().retired);
+            for (InstrumentedType* type : Registry().types)
+                counters->Flush(type, type->id.load(std::memory_order_relaxed));
+            auto& threads = Registry().threads;
+            threads.erase(std::find(threads.begin(), threads.end(), counters));
+            delete counters;
+            exited = true;
+        }
+        ThreadCounters* counters;
+    };
+
+    static ThreadCounters* Local() {
+        thread_local Holder holder;
+        return holder.counters;
+    }
+
+    // Every kind of event counts down its own interval, drawn from a geometric distribution:
+    // each event is sampled independently of the others, so a periodic pattern of events, such
+    // as a copy always followed by a drop, can't line up with the samples.
+    static bool Sampled(InstrumentedEvent event, uint32_t sample_period) {
+        if (sample_period == 1)
+            return true;
+        thread_local uint32_t countdown[kEventCount] = {};
+        uint32_t& left = countdown[size_t(event)];
+        if (left == 0)
+            left = NextInterval(sample_period);
+        return --left == 0;
+    }
+
+    static uint32_t NextInterval(uint32_t sample_period) {
+        thread_local std::minstd_rand engine(std::random_device{}());
+        std::geometric_distribution<uint32_t> distribution(1.0 / sample_period);
+        return distribution(engine) + 1;
+    }
+
+    // Types registered after the table is full are not counted.
+    static constexpr int kUnregistered = -2;
+
+    static inline std::atomic<uint32_t> period{1};
+    // Set once the counters of this thread are gone, events from later thread-local
+    // destructors are dropped.
+    static inline thread_local bool exited = false;
+};
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>  // std::nullptr_t
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Counting policies for RefCounted and WeakRefCounted.
+struct AtomicRefCountPolicy {
+    using Counter = std::atomic<size_t>;
+
+    static void Increment(Counter& count) {
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+    static bool IncrementIfNotZero(Counter& count) {
+        size_t value = count.load(std::memory_order_relaxed);
+        do {
+            if (value == 0)
+                return false;
+        } while (!count.compare_exchange_weak(value, value + 1, std::memory_order_acq_rel,
+                                              std::memory_order_relaxed));
+        return true;
+    }
+    // Returns true when the last reference is gone.
+    static bool Decrement(Counter& count) {
+        if (count.fetch_sub(1, std::memory_order_release) == 1) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return true;
+        }
+        return false;
+    }
+    static size_t Load(const Counter& count) {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+// For objects that never leave one thread.
+struct NonAtomicRefCountPolicy {
+    using Counter = size_t;
+
+    static void Increment(Counter& count) {
+        ++count;
+    }
+    static bool IncrementIfNotZero(Counter& count) {
+        if (count == 0)
+            return false;
+        ++count;
+        return true;
+    }
+    static bool Decrement(Counter& count) {
+        return --count == 0;
+    }
+    static size_t Load(const Counter& count) {
+        return count;
+    }
+};
+
+// CRTP base that keeps the reference count inside the object. The object is deleted as T,
+// so a hierarchy needs a virtual destructor in T.
+template <typename T, typename Policy = AtomicRefCountPolicy>
+class RefCounted {
+public:
+    void IncRef() const {
+        Policy::Increment(ref_count);
+    }
+    void DecRef() const {
+        if (Policy::Decrement(ref_count))
+            delete static_cast<const T*>(this);
+    }
+    size_t UseCount() const {
+        return Policy::Load(ref_count);
+    }
+
+protected:
+    RefCounted() noexcept : ref_count(0) {
+    }
+    RefCounted(const RefCounted&) noexcept : ref_count(0) {
+    }
+    RefCounted& operator=(const RefCounted&) noexcept {
+        return *this;
+    }
+    ~RefCounted() = default;
+
+private:
+    mutable typename Policy::Counter ref_count;
+};
+
+class WeakRefCountedBase {};
+
+// Weak-capable variant. The object has to outlive its destructor for as long as weak
+// references exist, so both counts live in a header placed right in front of the object in
+// the same allocation. Such objects must be created with MakeIntrusive, IntrusivePtr does not
+// adopt raw pointers to them.
+template <typename T, typename Policy = AtomicRefCountPolicy>
+class WeakRefCounted : public WeakRefCountedBase {
+public:
+    struct Header {
+        typename Policy::Counter ref_count{0};
+        // The strong references together hold one weak reference.
+        typename Policy::Counter weak_count{1};
+    };
+
+    void IncRef() const {
+        Policy::Increment(GetHeader()->ref_count);
+    }
+    void DecRef() const {
+        Header* header = GetHeader();
+        if (Policy::Decrement(header->ref_count)) {
+            static_cast<const T*>(this)->~T();
+            DecWeakRef(header);
+        }
+    }
+    size_t UseCount() const {
+        return Policy::Load(GetHeader()->ref_count);
+    }
+
+    // Used by WeakIntrusivePtr. They only look at the header, so they are safe to call after
+    // the object has been destroyed.
+    static size_t UseCountOf(const T* object) {
+        return Policy::Load(HeaderOf(object)->ref_count);
+    }
+    static bool TryIncRef(const T* object) {
+        return Policy::IncrementIfNotZero(HeaderOf(object)->ref_count);
+    }
+    static void IncWeakRef(const T* object) {
+        Policy::Increment(HeaderOf(object)->weak_count);
+    }
+    static void DecWeakRef(const T* object) {
+        DecWeakRef(HeaderOf(object));
+    }
+
+    template <typename... Args>
+    static T* Create(Args&&... args) {
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+        void* buffer = ::operator new(ObjectOffset() + sizeof(T));
+        Header* header = new (buffer) Header();
+        try {
+            void* object = static_cast<char*>(buffer) + ObjectOffset();
+            return new (object) T(std::forward<Args>(args)...);
+        } catch (...) {
+            header->~Header();
+            ::operator delete(buffer);
+            throw;
+        }
+    }
+
+protected:
+    WeakRefCounted() noexcept = default;
+    WeakRefCounted(const WeakRefCounted&) noexcept {
+    }
+    WeakRefCounted& operator=(const WeakRefCounted&) noexcept {
+        return *this;
+    }
+    ~WeakRefCounted() = default;
+
+private:
+    static constexpr size_t ObjectOffset() {
+        return (sizeof(Header) + alignof(T) - 1) / alignof(T) * alignof(T);
+    }
+    static Header* HeaderOf(const T* object) {
+        return reinterpret_cast<Header*>(
+            const_cast<char*>(reinterpret_cast<const char*>(object)) - ObjectOffset());
+    }
+    Header* GetHeader() const {
+        return HeaderOf(static_cast<const T*>(this));
+    }
+    static void DecWeakRef(Header* header) {
+        if (Policy::Decrement(header->weak_count)) {
+            header->~Header();
+            ::operator delete(header);
+        }
+    }
+};
+
+// One word: the pointer itself, the count lives in T.
+template <typename T>
+class IntrusivePtr {
+public:
+    IntrusivePtr() noexcept : ptr(nullptr) {
+    }
+    IntrusivePtr(std::nullptr_t) noexcept : ptr(nullptr) {
+    }
+    // add_ref == false adopts a reference that was already taken.
+    template <typename U = T,
+              typename = typename std::enable_if_t<!std::is_base_of_v<WeakRefCountedBase, U>>>
+    explicit IntrusivePtr(T* ptr_, bool add_ref = true) noexcept
+        : IntrusivePtr(ptr_, add_ref, AdoptTag()) {
+    }
+
+    IntrusivePtr(const IntrusivePtr& other) noexcept : ptr(other.ptr) {
+        if (ptr)
+            ptr->IncRef();
+    }
+    template <typename U, typename = typename std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    IntrusivePtr(const IntrusivePtr<U>& other) noexcept : ptr(other.Get()) {
+        if (ptr)
+            ptr->IncRef();
+    }
+
+    IntrusivePtr(IntrusivePtr&& other) noexcept : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+    template <typename U, typename = typename std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    IntrusivePtr(IntrusivePtr<U>&& other) noexcept : ptr(other.Detach()) {
+    }
+
+    IntrusivePtr& operator=(const IntrusivePtr& other) {
+        IntrusivePtr(other).Swap(*this);
+        return *this;
+    }
+    IntrusivePtr& operator=(IntrusivePtr&& other) {
+        IntrusivePtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ~IntrusivePtr() {
+        if (ptr)
+            ptr->DecRef();
+    }
+
+    void Reset() {
+        IntrusivePtr().Swap(*this);
+    }
+    template <typename U,
+              typename = typename std::enable_if_t<std::is_convertible_v<U*, T*> &&
+                                                   !std::is_base_of_v<WeakRefCountedBase, U>>>
+    void Reset(U* other) {
+        IntrusivePtr(other).Swap(*this);
+    }
+
+    // Gives up ownership without touching the count.
+    T* Detach() {
+        T* result = ptr;
+        ptr = nullptr;
+        return result;
+    }
+
+    void Swap(IntrusivePtr& other) {
+        std::swap(ptr, other.ptr);
+    }
+
+    T* Get() const {
+        return ptr;
+    }
+    T& operator*() const {
+        return *Get();
+    }
+    T* operator->() const {
+        return Get();
+    }
+    size_t UseCount() const {
+        if (!ptr)
+            return 0;
+        return ptr->UseCount();
+    }
+    explicit operator bool() const {
+        return ptr != nullptr;
+    }
+
+private:
+    struct AdoptTag {};
+
+    // For any T, the raw pointer constructor forwards here.
+    IntrusivePtr(T* ptr_, bool add_ref, AdoptTag) noexcept : ptr(ptr_) {
+        if (ptr && add_ref)
+            ptr->IncRef();
+    }
+
+    T* ptr;
+
+    template <typename U>
+    friend class WeakIntrusivePtr;
+
+    template <typename U, typename... Args>
+    friend IntrusivePtr<U> MakeIntrusive(Args&&... args);
+};
+
+template <typename T, typename U>
+inline bool operator==(const IntrusivePtr<T>& left, const IntrusivePtr<U>& right) {
+    return left.Get() == right.Get();
+}
+
+// Also one word. Works for types derived from WeakRefCounted<T>.
+template <typename T>
+class WeakIntrusivePtr {
+public:
+    WeakIntrusivePtr() noexcept : ptr(nullptr) {
+    }
+    WeakIntrusivePtr(const IntrusivePtr<T>& other) noexcept : ptr(other.Get()) {
+        if (ptr)
+            T::IncWeakRef(ptr);
+    }
+    WeakIntrusivePtr(const WeakIntrusivePtr& other) noexcept : ptr(other.ptr) {
+        if (ptr)
+            T::IncWeakRef(ptr);
+    }
+    WeakIntrusivePtr(WeakIntrusivePtr&& other) noexcept : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+
+    WeakIntrusivePtr& operator=(const WeakIntrusivePtr& other) {
+        WeakIntrusivePtr(other).Swap(*this);
+        return *this;
+    }
+    WeakIntrusivePtr& operator=(WeakIntrusivePtr&& other) {
+        WeakIntrusivePtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ~WeakIntrusivePtr() {
+        if (ptr)
+            T::DecWeakRef(ptr);
+    }
+
+    void Reset() {
+        WeakIntrusivePtr().Swap(*this);
+    }
+    void Swap(WeakIntrusivePtr& other) {
+        std::swap(ptr, other.ptr);
+    }
+
+    size_t UseCount() const {
+        if (!ptr)
+            return 0;
+        return T::UseCountOf(ptr);
+    }
+    bool Expired() const {
+        return UseCount() == 0;
+    }
+    IntrusivePtr<T> Lock() const {
+        if (ptr && T::TryIncRef(ptr))
+            return IntrusivePtr<T>(ptr, false, typename IntrusivePtr<T>::AdoptTag());
+        return IntrusivePtr<T>();
+    }
+
+private:
+    T* ptr;
+};
+
+template <typename T, typename... Args>
+IntrusivePtr<T> MakeIntrusive(Args&&... args) {
+    if constexpr (std::is_base_of_v<WeakRefCountedBase, T>)
+        return IntrusivePtr<T>(T::Create(std::forward<Args>(args)...), true,
+                               typename IntrusivePtr<T>::AdoptTag());
+    else
+        return IntrusivePtr<T>(new T(std::forward<Args>(args)...));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include "shared_ptr.h"
+#include "weak_ptr.h"
+
+// Function objects for ordered and hashed containers of SharedPtrs and WeakPtrs keyed by
+// ownership instead of by the stored pointer. Both kinds of pointers can be mixed, and
+// WeakPtrs keep their place after they expire, so nothing has to be locked.
+struct OwnerLess {
+    using is_transparent = void;
+
+    template <typename L, typename R>
+    bool operator()(const L& left, const R& right) const noexcept {
+        return left.OwnerBefore(right);
+    }
+};
+
+struct OwnerHash {
+    using is_transparent = void;
+
+    template <typename P>
+    size_t operator()(const P& ptr) const noexcept {
+        return ptr.OwnerHash();
+    }
+};
+
+struct OwnerEqual {
+    using is_transparent = void;
+
+    template <typename L, typename R>
+    bool operator()(const L& left, const R& right) const noexcept {
+        return left.OwnerEqual(right);
+    }
+};
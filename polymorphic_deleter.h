@@ -0,0 +1,203 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "unique_ptr.h"
+
+template <typename T>
+class PolymorphicDeleter;
+
+template <typename D>
+struct IsPolymorphicDeleter : std::false_type {};
+
+template <typename T>
+struct IsPolymorphicDeleter<PolymorphicDeleter<T>> : std::true_type {};
+
+// Shared by all PolymorphicDeleters, so a converted one keeps the table of its source.
+struct PolymorphicDeleterOps {
+    // Moves the deleter at from to the uninitialized buffer at to and destroys the source.
+    void (*relocate)(void* from, void* to) noexcept;
+    void (*destroy)(void* storage) noexcept;
+    bool allocated;
+};
+
+// A deleter that holds any deleter callable with a T*, so that UniquePtrs with different
+// deleters become one type, AnyUniquePtr<T>. Deleters of up to kBufferSize bytes that move
+// without throwing live in an inline buffer and never allocate, larger ones are put on the
+// heap. The deleter is called through a function pointer kept next to the buffer, with the
+// object as the type the deleter was made for. Moving and destroying go through a static ops
+// table, which trivially copyable deleters don't need: a stateless deleter is just that
+// function pointer.
+//
+// A deleter in the buffer is moved with its move constructor, so it may point into itself.
+// This is why PolymorphicDeleter, and AnyUniquePtr with it, is not trivially relocatable.
+template <typename T>
+class PolymorphicDeleter {
+    using Element = std::remove_extent_t<T>;
+    using Pointer = Element*;
+
+public:
+    static constexpr size_t kBufferSize = 2 * sizeof(void*);
+
+    PolymorphicDeleter() noexcept : PolymorphicDeleter(DefaultDeleter<T>()) {
+    }
+
+    template <typename D, typename = std::enable_if_t<
+                              !IsPolymorphicDeleter<std::decay_t<D>>::value &&
+                              std::is_invocable_v<std::decay_t<D>&, Pointer>>>
+    PolymorphicDeleter(D&& deleter) noexcept(kNothrowStore<D>)
+        : PolymorphicDeleter(std::in_place_type<Element>, std::forward<D>(deleter), 0) {
+    }
+
+    // Calls deleter with a U*, for a UniquePtr<U, D> converted to a UniquePtr<T>: the object
+    // is destroyed as a U even if T has no virtual destructor. offset_ is how far the T is from
+    // the start of the U, see ConvertDeleter.
+    template <typename U, typename D,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<D>, PolymorphicDeleter> &&
+                                          !std::is_same_v<std::decay_t<D>, PolymorphicDeleter<U>> &&
+                                          std::is_convertible_v<U*, Pointer> &&
+                                          std::is_invocable_v<std::decay_t<D>&, U*>>>
+    PolymorphicDeleter(std::in_place_type_t<U>, D&& deleter,
+                       std::ptrdiff_t offset_) noexcept(kNothrowStore<D>)
+        : offset(offset_) {
+        using Stored = std::decay_t<D>;
+        if constexpr (kFitsInline<Stored>) {
+            ::new (static_cast<void*>(buffer)) Stored(std::forward<D>(deleter));
+            call = &CallInline<U, Stored>;
+            ops = std::is_trivially_copyable_v<Stored> ? nullptr : &InlineOps<Stored>::value;
+        } else {
+            ::new (static_cast<void*>(buffer)) Stored*(new Stored(std::forward<D>(deleter)));
+            call = &CallHeap<U, Stored>;
+            ops = &HeapOps<Stored>::value;
+        }
+    }
+
+    // other is left holding DefaultDeleter<T>.
+    PolymorphicDeleter(PolymorphicDeleter&& other) noexcept {
+        TakeFrom(other);
+    }
+
+    // For AnyUniquePtr<Derived> converted to AnyUniquePtr<Base>: the stored deleter is moved
+    // over as it is, only the offset of the base inside the object is added. Never allocates.
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, Pointer>>>
+    PolymorphicDeleter(std::in_place_type_t<U>, PolymorphicDeleter<U>&& other,
+                       std::ptrdiff_t adjust) noexcept {
+        TakeFrom(other, adjust);
+    }
+
+    PolymorphicDeleter& operator=(PolymorphicDeleter&& other) noexcept {
+        if (this != &other) {
+            Destroy();
+            TakeFrom(other);
+        }
+        return *this;
+    }
+
+    PolymorphicDeleter(const PolymorphicDeleter&) = delete;
+    PolymorphicDeleter& operator=(const PolymorphicDeleter&) = delete;
+
+    ~PolymorphicDeleter() {
+        Destroy();
+    }
+
+    void operator()(Pointer ptr) const {
+        void* object = const_cast<void*>(static_cast<const void*>(ptr));
+        call(buffer, ptr ? static_cast<char*>(object) - offset : nullptr);
+    }
+
+    // Whether the stored deleter is on the heap.
+    bool IsAllocated() const {
+        return ops != nullptr && ops->allocated;
+    }
+
+private:
+    using Ops = PolymorphicDeleterOps;
+
+    template <typename D>
+    static constexpr bool kFitsInline = sizeof(D) <= kBufferSize &&
+                                        alignof(D) <= alignof(void*) &&
+                                        std::is_nothrow_move_constructible_v<D>;
+
+    template <typename D>
+    static constexpr bool kNothrowStore =
+        kFitsInline<std::decay_t<D>> && std::is_nothrow_constructible_v<std::decay_t<D>, D&&>;
+
+    template <typename U, typename D>
+    static void CallInline(void* storage, void* ptr) {
+        (*std::launder(static_cast<D*>(storage)))(static_cast<U*>(ptr));
+    }
+
+    template <typename U, typename D>
+    static void CallHeap(void* storage, void* ptr) {
+        (**std::launder(static_cast<D**>(storage)))(static_cast<U*>(ptr));
+    }
+
+    template <typename D>
+    struct InlineOps {
+        static void Relocate(void* from, void* to) noexcept {
+            D* source = std::launder(static_cast<D*>(from));
+            ::new (to) D(std::move(*source));
+            source->~D();
+        }
+        static void Destroy(void* storage) noexcept {
+            std::launder(static_cast<D*>(storage))->~D();
+        }
+
+        static constexpr Ops value = {&Relocate, &Destroy, false};
+    };
+
+    template <typename D>
+    struct HeapOps {
+        static void Relocate(void* from, void* to) noexcept {
+            std::memcpy(to, from, sizeof(D*));
+        }
+        static void Destroy(void* storage) noexcept {
+            delete *std::launder(static_cast<D**>(storage));
+        }
+
+        static constexpr Ops value = {&Relocate, &Destroy, true};
+    };
+
+    // adjust is the offset of T inside the element type of other.
+    template <typename U>
+    void TakeFrom(PolymorphicDeleter<U>& other, std::ptrdiff_t adjust = 0) noexcept {
+        call = other.call;
+        ops = other.ops;
+        offset = other.offset + adjust;
+        if (ops)
+            ops->relocate(other.buffer, buffer);
+        else
+            std::memcpy(buffer, other.buffer, kBufferSize);
+        other.Clear();
+    }
+
+    void Clear() noexcept {
+        ::new (static_cast<void*>(buffer)) DefaultDeleter<T>();
+        call = &CallInline<Element, DefaultDeleter<T>>;
+        ops = nullptr;
+        offset = 0;
+    }
+
+    void Destroy() noexcept {
+        if (ops)
+            ops->destroy(buffer);
+    }
+
+    void (*call)(void* storage, void* ptr);
+    const Ops* ops;
+    // Subtracted from a T* to get the object call expects.
+    std::ptrdiff_t offset = 0;
+    alignas(void*) mutable unsigned char buffer[kBufferSize] = {};
+
+    template <typename U>
+    friend class PolymorphicDeleter;
+};
+
+// A UniquePtr that takes over UniquePtrs of T or of classes derived from it, whatever their
+// deleters: UniquePtr<Derived, D> converts to AnyUniquePtr<Base> and is still deleted by D as
+// a Derived.
+template <typename T>
+using AnyUniquePtr = UniquePtr<T, PolymorphicDeleter<T>>;
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include "relocate.h"
+
+// A vector for smart pointers and other trivially relocatable types. Growing, inserting and
+// erasing move the elements with memmove instead of a move constructor and a destructor call
+// per element, so neither the pointees nor their reference counts are touched. Other types
+// are moved one by one and must not throw while moving.
+template <typename T>
+class PtrVector {
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    PtrVector() noexcept = default;
+
+    // The destructor cleans up once the delegated constructor has finished.
+    PtrVector(const PtrVector& other) : PtrVector() {
+        Insert(end(), other.begin(), other.end());
+    }
+
+    PtrVector(PtrVector&& other) noexcept
+        : data(std::exchange(other.data, nullptr)), size(std::exchange(other.size, 0)),
+          capacity(std::exchange(other.capacity, 0)) {
+    }
+
+    PtrVector& operator=(const PtrVector& other) {
+        PtrVector(other).Swap(*this);
+        return *this;
+    }
+
+    PtrVector& operator=(PtrVector&& other) noexcept {
+        PtrVector(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ~PtrVector() {
+        Clear();
+        ::operator delete(data);
+    }
+
+    void Swap(PtrVector& other) noexcept {
+        std::swap(data, other.data);
+        std::swap(size, other.size);
+        std::swap(capacity, other.capacity);
+    }
+
+    size_t Size() const {
+        return size;
+    }
+    size_t Capacity() const {
+        return capacity;
+    }
+    bool Empty() const {
+        return size == 0;
+    }
+
+    T* Data() {
+        return data;
+    }
+    const T* Data() const {
+        return data;
+    }
+    T& operator[](size_t index) {
+        return data[index];
+    }
+    const T& operator[](size_t index) const {
+        return data[index];
+    }
+    T& Back() {
+        return data[size - 1];
+    }
+
+    T* begin() {
+        return data;
+    }
+    T* end() {
+        return data + size;
+    }
+    const T* begin() const {
+        return data;
+    }
+    const T* end() const {
+        return data + size;
+    }
+
+    void Reserve(size_t capacity_) {
+        if (capacity_ > capacity)
+            Reallocate(capacity_, size, 0);
+    }
+
+    template <typename... Args>
+    T& EmplaceBack(Args&&... args) {
+        return *Emplace(end(), std::forward<Args>(args)...);
+    }
+    void PushBack(const T& value) {
+        EmplaceBack(value);
+    }
+    void PushBack(T&& value) {
+        EmplaceBack(std::move(value));
+    }
+    void PopBack() {
+        data[--size].~T();
+    }
+
+    // The new element is built aside and relocated into the gap, so args may refer to
+    // elements of this vector.
+    template <typename... Args>
+    T* Emplace(const T* pos, Args&&... args) {
+        size_t index = pos - data;
+        alignas(T) unsigned char storage[sizeof(T)];
+        T* value = ::new (static_cast<void*>(storage)) T(std::forward<Args>(args)...);
+        try {
+            OpenGap(index, 1);
+        } catch (...) {
+            value->~T();
+            throw;
+        }
+        Relocate(value, data + index);
+        ++size;
+        return data + index;
+    }
+    T* Insert(const T* pos, const T& value) {
+        return Emplace(pos, value);
+    }
+    T* Insert(const T* pos, T&& value) {
+        return Emplace(pos, std::move(value));
+    }
+
+    // Copies [first, last), which must not point into this vector. If a copy throws, the
+    // vector keeps its elements.
+    template <typename It>
+    T* Insert(const T* pos, It first, It last) {
+        size_t index = pos - data;
+        size_t count = std::distance(first, last);
+        OpenGap(index, count);
+        T* gap = data + index;
+        size_t built = 0;
+        try {
+            for (; first != last; ++first, ++built)
+                ::new (static_cast<void*>(gap + built)) T(*first);
+        } catch (...) {
+            std::destroy(gap, gap + built);
+            UninitializedRelocate(gap + count, data + size + count, gap);
+            throw;
+        }
+        size += count;
+        return gap;
+    }
+
+    T* Erase(const T* pos) {
+        return Erase(pos, pos + 1);
+    }
+    T* Erase(const T* first_, const T* last_) {
+        T* first = data + (first_ - data);
+        T* last = data + (last_ - data);
+        std::destroy(first, last);
+        UninitializedRelocate(last, end(), first);
+        size -= last - first;
+        return first;
+    }
+
+    void Clear() {
+        std::destroy(begin(), end());
+        size = 0;
+    }
+
+private:
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    // Makes room for count elements at index, the elements behind it move up. size is left
+    // as it is.
+    void OpenGap(size_t index, size_t count) {
+        if (size + count <= capacity) {
+            UninitializedRelocate(data + index, data + size, data + index + count);
+            return;
+        }
+        Reallocate(std::max(size + count, capacity * 2), index, count);
+    }
+
+    // Leaves count uninitialized slots at index in the new buffer.
+    void Reallocate(size_t capacity_, size_t index, size_t count) {
+        T* buffer = static_cast<T*>(::operator new(capacity_ * sizeof(T)));
+        UninitializedRelocate(data, data + index, buffer);
+        UninitializedRelocate(data + index, data + size, buffer + index + count);
+        ::operator delete(data);
+        data = buffer;
+        capacity = capacity_;
+    }
+
+    T* data = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+};
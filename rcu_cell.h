@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "shared_ptr.h"
+#include "unique_ptr.h"
+
+// Epoch-based reclamation shared by all RcuCells. Every thread that reads gets a record with
+// the epoch it entered at (0 while outside of a read section). A writer advances the global
+// epoch after unpublishing a value and frees the value once no record is older than that.
+class EpochDomain {
+public:
+    struct Record {
+        std::atomic<uint64_t> epoch{0};
+        // Only touched by the owning thread, read sections nest.
+        size_t depth = 0;
+        std::atomic<bool> in_use{true};
+        Record* next = nullptr;
+    };
+
+    static EpochDomain& Global() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    Record* LocalRecord() {
+        thread_local Holder holder(*this);
+        return holder.record;
+    }
+
+    void Enter(Record* record) {
+        if (record->depth++ != 0)
+            return;
+        // Acquire pairs with Advance: a reader that sees the new epoch also sees the value
+        // published before it.
+        record->epoch.store(epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+        // Either the writer sees our record or we see its new value, never neither.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    void Exit(Record* record) {
+        if (--record->depth == 0)
+            record->epoch.store(0, std::memory_order_release);
+    }
+
+    // Called by writers after they have unpublished a value. Returns the epoch that all
+    // readers have to reach before the value can be freed.
+    uint64_t Advance() {
+        uint64_t result = epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return result;
+    }
+
+    // The oldest epoch some reader is still in, or the current one when nobody reads.
+    uint64_t MinActive() const {
+        uint64_t result = epoch.load(std::memory_order_acquire);
+        for (Record* record = records.load(std::memory_order_acquire); record;
+             record = record->next) {
+            uint64_t value = record->epoch.load(std::memory_order_acquire);
+            if (value != 0 && value < result)
+                result = value;
+        }
+        return result;
+    }
+
+private:
+    EpochDomain() = default;
+
+    // Records are never freed, a thread that exits leaves its record for the next one.
+    struct Holder {
+        explicit Holder(EpochDomain& domain) : record(domain.Acquire()) {
+        }
+        ~Holder() {
+            record->in_use.store(false, std::memory_order_release);
+        }
+        Record* record;
+    };
+
+    Record* Acquire() {
+        for (Record* record = records.load(std::memory_order_acquire); record;
+             record = record->next) {
+            bool in_use = false;
+            if (!record->in_use.load(std::memory_order_relaxed) &&
+                record->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire))
+                return record;
+        }
+        Record* record = new Record();
+        Record* head = records.load(std::memory_order_relaxed);
+        do {
+            record->next = head;
+        } while (!records.compare_exchange_weak(head, record, std::memory_order_release,
+                                                std::memory_order_relaxed));
+        return record;
+    }
+
+    std::atomic<uint64_t> epoch{1};
+    std::atomic<Record*> records{nullptr};
+};
+
+// Holds a SharedPtr<T> for read-mostly data. Readers borrow the current value without touching
+// any shared counter; writers publish a new SharedPtr and the old one is released once every
+// reader that could still see it has left its read section.
+template <typename T>
+class RcuCell {
+public:
+    // A read section. The borrowed value stays valid until the Snapshot is destroyed, Promote
+    // turns it into an owning SharedPtr that may outlive it. Other readers may see the same
+    // value at the same time, so it is only handed out as const.
+    class Snapshot {
+    public:
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        ~Snapshot() {
+            EpochDomain::Global().Exit(record);
+        }
+
+        const T* Get() const {
+            return value->Get();
+        }
+        const T& operator*() const {
+            return *Get();
+        }
+        const T* operator->() const {
+            return Get();
+        }
+        explicit operator bool() const {
+            return Get() != nullptr;
+        }
+        SharedPtr<T> Promote() const {
+            return *value;
+        }
+
+    private:
+        explicit Snapshot(const RcuCell& cell) : record(EpochDomain::Global().LocalRecord()) {
+            EpochDomain::Global().Enter(record);
+            value = cell.current.load(std::memory_order_acquire);
+        }
+
+        EpochDomain::Record* record;
+        const SharedPtr<T>* value;
+
+        friend class RcuCell;
+    };
+
+    RcuCell() : current(new SharedPtr<T>()) {
+    }
+    explicit RcuCell(SharedPtr<T> value) : current(new SharedPtr<T>(std::move(value))) {
+    }
+    RcuCell(const RcuCell&) = delete;
+    RcuCell& operator=(const RcuCell&) = delete;
+
+    // No reader may be inside a read section of this cell any more.
+    ~RcuCell() {
+        delete current.load(std::memory_order_relaxed);
+    }
+
+    Snapshot Read() const {
+        return Snapshot(*this);
+    }
+    SharedPtr<T> Load() const {
+        return Read().Promote();
+    }
+
+    void Store(SharedPtr<T> value) {
+        // The SharedPtr itself lives on the heap, so readers can promote from it after the
+        // cell has moved on.
+        UniquePtr<SharedPtr<T>> node(new SharedPtr<T>(std::move(value)));
+        // Declared before the lock, so the values are released after it.
+        std::vector<Retired> expired;
+        std::lock_guard<std::mutex> lock(mutex);
+        UniquePtr<SharedPtr<T>> old(current.exchange(node.Release(), std::memory_order_acq_rel));
+        retired.push_back(Retired{EpochDomain::Global().Advance(), std::move(old)});
+        expired = TakeExpiredLocked();
+    }
+
+    // Frees retired values whose readers are gone. Store does this on its own, call it when
+    // writes stop for a long time.
+    void Reclaim() {
+        std::vector<Retired> expired;
+        std::lock_guard<std::mutex> lock(mutex);
+        expired = TakeExpiredLocked();
+    }
+
+private:
+    struct Retired {
+        uint64_t epoch;
+        UniquePtr<SharedPtr<T>> node;
+    };
+
+    // The caller drops the returned values once it has released the mutex: a destructor of T
+    // may Store to this cell again. Epochs are taken under the mutex, so retired is in epoch
+    // order and the expired values are a prefix of it.
+    std::vector<Retired> TakeExpiredLocked() {
+        uint64_t min_active = EpochDomain::Global().MinActive();
+        auto end = std::find_if(retired.begin(), retired.end(), [&](const Retired& old) {
+            return old.epoch > min_active;
+        });
+        std::vector<Retired> expired(std::make_move_iterator(retired.begin()),
+                                     std::make_move_iterator(end));
+        retired.erase(retired.begin(), end);
+        return expired;
+    }
+
+    std::atomic<SharedPtr<T>*> current;
+    std::mutex mutex;
+    std::vector<Retired> retired;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Types whose objects can be moved to another address with memcpy, after which the source is
+// dead and is not destroyed. True for trivially copyable types; the smart pointers specialize
+// it, they only hold pointers that nothing else refers to.
+template <typename T>
+struct IsTriviallyRelocatable : std::is_trivially_copyable<T> {};
+
+template <typename T>
+inline constexpr bool kIsTriviallyRelocatable = IsTriviallyRelocatable<T>::value;
+
+// Moves [first, last) to the uninitialized storage at dest and ends the lifetime of the
+// sources. The ranges may overlap. Other types are moved and destroyed one by one, in an
+// order that is safe for overlapping ranges, so their moves must not throw.
+template <typename T>
+T* UninitializedRelocate(T* first, T* last, T* dest) noexcept {
+    size_t count = last - first;
+    if constexpr (kIsTriviallyRelocatable<T>) {
+        if (count != 0)
+            std::memmove(static_cast<void*>(dest), static_cast<const void*>(first),
+                         count * sizeof(T));
+    } else {
+        static_assert(std::is_nothrow_move_constructible_v<T>);
+        if (dest < first) {
+            for (size_t i = 0; i < count; ++i) {
+                ::new (static_cast<void*>(dest + i)) T(std::move(first[i]));
+                first[i].~T();
+            }
+        } else {
+            for (size_t i = count; i > 0; --i) {
+                ::new (static_cast<void*>(dest + i - 1)) T(std::move(first[i - 1]));
+                first[i - 1].~T();
+            }
+        }
+    }
+    return dest + count;
+}
+
+template <typename T>
+void Relocate(T* source, T* dest) noexcept {
+    UninitializedRelocate(source, source + 1, dest);
+}
@@ -1,37 +1,103 @@
 #pragma once
 
 #include <cstddef> // std::nullptr_t
+#include <functional>
+#include <vector>
 #include "shared_weak_fwd.h"
 #include "control_block.h"
 #include "bad_weak_ptr.h"
+#include "relocate.h"
+#include "unique_ptr.h"
+
+// A raw U* may be adopted by SharedPtr<T>; for arrays only qualification conversions are allowed.
+template <typename U, typename T>
+inline constexpr bool is_raw_pointer_compatible =
+    std::is_array_v<T> ? std::is_convertible_v<U (*)[], std::remove_extent_t<T> (*)[]>
+                       : std::is_convertible_v<U*, T*>;
 
 template <typename T>
 class SharedPtr {
 public:
+    using element_type = std::remove_extent_t<T>;
+
     SharedPtr() noexcept : block(nullptr), obj(nullptr) {
     }
     SharedPtr(std::nullptr_t) noexcept : block(nullptr), obj(nullptr) {
     }
 
     template <typename U>
-    SharedPtr(U* ptr) noexcept
-        : block(static_cast<ControlBlock*>(new ControlBlockPointerImp<U>(ptr))),
-          obj(static_cast<T*>(ptr)) {
+    SharedPtr(U* ptr) noexcept : block(NewPointerBlock(ptr)), obj(static_cast<element_type*>(ptr)) {
         if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
             InitWeakThis(ptr);
         }
     }
 
-    explicit SharedPtr(T* ptr) noexcept
-        : block(static_cast<ControlBlock*>(new ControlBlockPointerImp<T>(ptr))), obj(ptr) {
+    explicit SharedPtr(T* ptr) noexcept : block(NewPointerBlock(ptr)), obj(ptr) {
         if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
             InitWeakThis(ptr);
         }
     }
 
+    // deleter(ptr) is called instead of delete, also when allocating the block fails.
+    template <typename U, typename Deleter,
+              typename = typename std::enable_if_t<is_raw_pointer_compatible<U, T>>>
+    SharedPtr(U* ptr, Deleter deleter)
+        : SharedPtr(ptr, std::move(deleter), std::allocator<std::remove_cv_t<U>>()) {
+    }
+
+    template <typename U, typename Deleter, typename Alloc,
+              typename = typename std::enable_if_t<is_raw_pointer_compatible<U, T>>>
+    SharedPtr(U* ptr, Deleter deleter, const Alloc& alloc)
+        : block(NewPointerBlock(ptr, std::move(deleter), alloc)),
+          obj(static_cast<element_type*>(ptr)) {
+        if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
+            InitWeakThis(ptr);
+        }
+    }
+
+    // The control block is allocated through alloc, ptr is deleted if that fails.
+    template <typename U, typename Alloc>
+    SharedPtr(std::allocator_arg_t, const Alloc& alloc, U* ptr)
+        : block(NewPointerBlock(ptr, alloc)), obj(static_cast<element_type*>(ptr)) {
+        if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
+            InitWeakThis(ptr);
+        }
+    }
+
+    // Objects from MakeUniqueShareable are adopted without allocating, the block is built in
+    // the space reserved in front of them. Any other UniquePtr gets a block of its own, if
+    // allocating it fails the object is destroyed.
+    template <typename U, typename Deleter,
+              typename = typename std::enable_if_t<std::is_convertible_v<U*, T*> &&
+                                                   !std::is_array_v<U>>>
+    SharedPtr(UniquePtr<U, Deleter>&& other) : block(nullptr), obj(nullptr) {
+        if (!other)
+            return;
+        U* ptr = other.Release();
+        // The object stays counted as one allocation: the UniquePtr counted it, the block
+        // counts it again.
+        if constexpr (kInstrumentation)
+            Instrumentation::Record(InstrumentedTypeOf<U>(), InstrumentedEvent::kFree);
+        if constexpr (std::is_same_v<Deleter, ShareableDeleter<U>>) {
+            using Block = ControlBlockShareableImp<U, ControlBlockBase<U>>;
+            if constexpr (std::is_same_v<ControlBlockBase<U>, BiasedControlBlock>)
+                MergeBiasedRefCounts();
+            block = Built(new (Block::BufferOf(ptr)) Block());
+        } else if constexpr (std::is_same_v<Deleter, DefaultDeleter<U>>) {
+            block = NewPointerBlock(ptr);
+        } else {
+            block = NewPointerBlock(ptr, std::move(other.GetDeleter()),
+                                    std::allocator<std::remove_cv_t<U>>());
+        }
+        obj = static_cast<element_type*>(ptr);
+        if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
+            InitWeakThis(ptr);
+        }
+    }
+
     template <typename U, typename = typename std::enable_if_t<std::is_convertible_v<U*, T*>>>
     SharedPtr(const SharedPtr<U>& other) noexcept
-        : block(other.block), obj(static_cast<T*>(other.Get())) {
+        : block(other.block), obj(static_cast<element_type*>(other.Get())) {
         if (block)
             block->IncRef();
     }
@@ -42,7 +108,7 @@ public:
 
     template <typename U, typename = typename std::enable_if_t<std::is_convertible_v<U*, T*>>>
     SharedPtr(SharedPtr<U>&& other) noexcept
-        : block(other.block), obj(static_cast<T*>(other.Get())) {
+        : block(other.block), obj(static_cast<element_type*>(other.Get())) {
         other.block = nullptr;
         other.obj = nullptr;
     }
@@ -52,27 +118,23 @@ public:
     }
 
     template <typename U>
-    SharedPtr(const SharedPtr<U>& other, T* ptr) noexcept : block(other.block), obj(ptr) {
+    SharedPtr(const SharedPtr<U>& other, element_type* ptr) noexcept
+        : block(other.block), obj(ptr) {
         if (block)
             block->IncRef();
     }
 
-    SharedPtr(const WeakPtr<T>& other) {
-        if (other.Expired())
+    SharedPtr(const WeakPtr<T>& other) : block(other.block), obj(other.obj) {
+        if (!block || !block->IncRefIfNotZero())
             throw BadWeakPtr();
-        block = other.block;
-        obj = other.obj;
-        if (block)
-            block->IncRef();
     }
 
     SharedPtr(const WeakPtr<T>& other, std::nothrow_t) noexcept
         : block(other.block), obj(other.obj) {
-        if (other.Expired()) {
+        if (block && !block->IncRefIfNotZero()) {
+            block = nullptr;
             obj = nullptr;
         }
-        if (block)
-            block->IncRef();
     }
 
     SharedPtr& operator=(const SharedPtr& other) {
@@ -90,6 +152,12 @@ public:
         return *this;
     }
 
+    template <typename U, typename Deleter>
+    SharedPtr& operator=(UniquePtr<U, Deleter>&& other) {
+        SharedPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
     SharedPtr& operator=(SharedPtr&& other) {
         if (this == &other) {
             return *this;
@@ -118,7 +186,7 @@ public:
         obj = nullptr;
     }
 
-    template <typename U, typename = typename std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    template <typename U, typename = typename std::enable_if_t<is_raw_pointer_compatible<U, T>>>
     void Reset(U* ptr = nullptr) {
         if (block) {
             block->DecRef();
@@ -127,25 +195,35 @@ public:
             obj = nullptr;
         }
         if (ptr) {
-            block = static_cast<ControlBlock*>(new ControlBlockPointerImp<U>(ptr));
-            obj = static_cast<T*>(ptr);
+            block = NewPointerBlock(ptr);
+            obj = static_cast<element_type*>(ptr);
         }
     }
 
+    template <typename U, typename Deleter,
+              typename = typename std::enable_if_t<is_raw_pointer_compatible<U, T>>>
+    void Reset(U* ptr, Deleter deleter) {
+        SharedPtr(ptr, std::move(deleter)).Swap(*this);
+    }
+
     void Swap(SharedPtr& other) {
         std::swap(block, other.block);
         std::swap(obj, other.obj);
     }
 
-    T* Get() const {
+    element_type* Get() const {
         return obj;
     }
-    T& operator*() const {
+    element_type& operator*() const {
         return *Get();
     }
-    T* operator->() const {
+    element_type* operator->() const {
         return Get();
     }
+    element_type& operator[](std::ptrdiff_t ind) const {
+        static_assert(std::is_array_v<T>);
+        return Get()[ind];
+    }
     size_t UseCount() const {
         if (!block)
             return 0;
@@ -155,53 +233,337 @@ public:
         return !(obj == nullptr);
     }
 
+    // nullptr unless the object was handed over with a deleter of exactly type D.
+    template <typename D>
+    D* GetDeleter() const noexcept {
+        if (!block)
+            return nullptr;
+        return static_cast<D*>(block->GetDeleter(&DeleterId<D>::id));
+    }
+
+    // Ownership-based ordering, equality and hashing: pointers sharing a control block are
+    // equivalent whatever they point to. Expired WeakPtrs work without being locked.
+    template <typename U>
+    bool OwnerBefore(const SharedPtr<U>& other) const noexcept {
+        return std::less<ControlBlock*>()(block, other.block);
+    }
+    template <typename U>
+    bool OwnerBefore(const WeakPtr<U>& other) const noexcept {
+        return std::less<ControlBlock*>()(block, other.block);
+    }
+    template <typename U>
+    bool OwnerEqual(const SharedPtr<U>& other) const noexcept {
+        return block == other.block;
+    }
+    template <typename U>
+    bool OwnerEqual(const WeakPtr<U>& other) const noexcept {
+        return block == other.block;
+    }
+    size_t OwnerHash() const noexcept {
+        return std::hash<ControlBlock*>()(block);
+    }
+
 private:
     ControlBlock* block;
-    T* obj;
+    element_type* obj;
 
-    SharedPtr(ControlBlock* block_, T* object) noexcept : block(block_), obj(object) {
+    // Takes over a freshly built block from one of the MakeShared functions.
+    SharedPtr(ControlBlock* block_, element_type* object) noexcept : block(block_), obj(object) {
+        block->RecordAllocation();
         if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
             InitWeakThis(object);
         }
     }
 
+    template <typename U>
+    static ControlBlock* NewPointerBlock(U* ptr) {
+        if constexpr (std::is_array_v<T>)
+            return NewPointerBlock(ptr, DefaultDeleter<U[]>(),
+                                   std::allocator<std::remove_cv_t<U>>());
+        else
+            return Built(ControlBlockPointerImp<U, ControlBlockBase<U>>::Create(ptr));
+    }
+
+    template <typename U, typename Alloc>
+    static ControlBlock* NewPointerBlock(U* ptr, const Alloc& alloc) {
+        if constexpr (std::is_array_v<T>) {
+            return NewPointerBlock(ptr, DefaultDeleter<U[]>(), alloc);
+        } else {
+            using Block = ControlBlockPointerAllocImp<U, Alloc, ControlBlockBase<U>>;
+            using BlockAlloc =
+                typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+            BlockAlloc block_alloc(alloc);
+            Block* block = nullptr;
+            try {
+                block = std::allocator_traits<BlockAlloc>::allocate(block_alloc, 1);
+            } catch (...) {
+                delete ptr;
+                throw;
+            }
+            return Built(new (block) Block(ptr, alloc));
+        }
+    }
+
+    template <typename U, typename Deleter, typename Alloc>
+    static ControlBlock* NewPointerBlock(U* ptr, Deleter&& deleter, const Alloc& alloc) {
+        using Block = ControlBlockPointerDeleterImp<U, Deleter, Alloc, ControlBlockBase<U>>;
+        using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+        BlockAlloc block_alloc(alloc);
+        Block* block = nullptr;
+        try {
+            block = std::allocator_traits<BlockAlloc>::allocate(block_alloc, 1);
+        } catch (...) {
+            deleter(ptr);
+            throw;
+        }
+        return Built(new (block) Block(ptr, std::move(deleter), alloc));
+    }
+
+    static ControlBlock* Built(ControlBlock* block) {
+        block->RecordAllocation();
+        return block;
+    }
+
     template <typename U>
     void InitWeakThis(EnableSharedFromThis<U>* e) {
-        e->weak_this = *this;
+        e->block = block;
     }
 
     template <typename U>
     friend class SharedPtr;
 
+    template <typename U>
+    friend class EnableSharedFromThis;
+
     template <typename U>
     friend class WeakPtr;
 
-    template <typename U, typename... Args>
-    friend SharedPtr<U> MakeShared(Args&&...);
+    template <typename U>
+    friend class AtomicSharedPtr;
+
+    template <typename U>
+    friend class CollectableSharedPtr;
+
+    template <typename U>
+    friend class ThinSharedPtr;
+
+    template <typename K, typename V>
+    friend class WeakKeyMap;
+
+    template <typename Key, typename U, typename Hash, typename Equal>
+    friend class WeakCache;
+
+    template <typename U, typename Base, typename... Args>
+    friend SharedPtr<U> MakeSharedImp(Args&&...);
+
+    template <typename U, typename Alloc, typename... Args>
+    friend SharedPtr<U> AllocateShared(const Alloc&, Args&&...);
+
+    template <typename U>
+    friend SharedPtr<U> MakeSharedArrayImp(size_t, bool);
+
+    template <typename U, typename Make>
+    friend std::vector<SharedPtr<U>> MakeSharedBatch(size_t, Make&&);
 };
 
+template <typename T>
+struct IsTriviallyRelocatable<SharedPtr<T>> : std::true_type {};
+
 template <typename T, typename U>
 inline bool operator==(const SharedPtr<T>& left, const SharedPtr<U>& right) {
     return left.Get() == right.Get();
 }
 
-template <typename T, typename... Args>
-SharedPtr<T> MakeShared(Args&&... args) {
-    void* buffer = nullptr;
+template <typename T, typename Base, typename... Args>
+SharedPtr<T> MakeSharedImp(Args&&... args) {
+    if constexpr (std::is_same_v<Base, BiasedControlBlock>)
+        MergeBiasedRefCounts();
+
+    using Block = ControlBlockObjectImp<T, Base>;
+    void* buffer = Block::Allocate();
     try {
-        buffer = ::operator new(sizeof(ControlBlockObjectImp<T>));
-        ControlBlockObjectImp<T>* block =
-            new (buffer) ControlBlockObjectImp<T>(std::forward<Args>(args)...);
+        Block* block = new (buffer) Block(std::forward<Args>(args)...);
+        return SharedPtr<T>(static_cast<ControlBlock*>(block), block->GetObject());
+    } catch (...) {
+        Block::Deallocate(buffer);
+        throw;
+    }
+}
 
+template <typename T>
+SharedPtr<T> MakeSharedArrayImp(size_t count, bool value_init) {
+    using Block = ControlBlockArrayImp<std::remove_extent_t<T>, ControlBlockBase<T>>;
+    if constexpr (std::is_same_v<ControlBlockBase<T>, BiasedControlBlock>)
+        MergeBiasedRefCounts();
+
+    void* buffer = Block::Allocate(count);
+    try {
+        Block* block = new (buffer) Block(count, value_init);
         return SharedPtr<T>(static_cast<ControlBlock*>(block), block->GetObject());
     } catch (...) {
-        ::operator delete(buffer);
+        Block::Deallocate(buffer);
+        throw;
+    }
+}
+
+template <typename T>
+inline constexpr bool is_unbounded_array = std::is_array_v<T> && std::extent_v<T> == 0;
+
+template <typename T>
+inline constexpr bool is_bounded_array = std::is_array_v<T> && std::extent_v<T> != 0;
+
+template <typename T, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, SharedPtr<T>> MakeShared(Args&&... args) {
+    return MakeSharedImp<T, ControlBlockBase<T>>(std::forward<Args>(args)...);
+}
+
+// MakeShared<T[]>(n) and MakeShared<T[N]>() value-initialize the elements.
+template <typename T>
+std::enable_if_t<is_unbounded_array<T>, SharedPtr<T>> MakeShared(size_t count) {
+    return MakeSharedArrayImp<T>(count, true);
+}
+
+template <typename T>
+std::enable_if_t<is_bounded_array<T>, SharedPtr<T>> MakeShared() {
+    return MakeSharedArrayImp<T>(std::extent_v<T>, true);
+}
+
+// Default-initialize instead: trivial types are left uninitialized, which saves zero-filling
+// buffers that are overwritten anyway.
+template <typename T>
+std::enable_if_t<!std::is_array_v<T>, SharedPtr<T>> MakeSharedForOverwrite() {
+    return MakeSharedImp<T, ControlBlockBase<T>>(ForOverwriteTag());
+}
+
+template <typename T>
+std::enable_if_t<is_unbounded_array<T>, SharedPtr<T>> MakeSharedForOverwrite(size_t count) {
+    return MakeSharedArrayImp<T>(count, false);
+}
+
+template <typename T>
+std::enable_if_t<is_bounded_array<T>, SharedPtr<T>> MakeSharedForOverwrite() {
+    return MakeSharedArrayImp<T>(std::extent_v<T>, false);
+}
+
+// Like MakeShared, but the single allocation for the block and the object comes from alloc,
+// which is kept in the block to free it.
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> AllocateShared(const Alloc& alloc, Args&&... args) {
+    using Base = ControlBlockBase<T>;
+    using Block = ControlBlockObjectAllocImp<T, Alloc, Base>;
+    using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+    if constexpr (std::is_same_v<Base, BiasedControlBlock>)
+        MergeBiasedRefCounts();
+
+    BlockAlloc block_alloc(alloc);
+    Block* block = std::allocator_traits<BlockAlloc>::allocate(block_alloc, 1);
+    try {
+        new (block) Block(alloc, std::forward<Args>(args)...);
+    } catch (...) {
+        std::allocator_traits<BlockAlloc>::deallocate(block_alloc, block, 1);
+        throw;
+    }
+    return SharedPtr<T>(static_cast<ControlBlock*>(block), block->GetObject());
+}
+
+// Biases the reference count towards the calling thread regardless of UseBiasedRefCount<T>.
+template <typename T, typename... Args>
+SharedPtr<T> MakeSharedBiased(Args&&... args) {
+    return MakeSharedImp<T, BiasedControlBlock>(std::forward<Args>(args)...);
+}
+
+// Spreads the reference count over ShardedControlBlock::kShards cache lines, for objects that
+// many threads copy and drop at the same time. The block takes about a kilobyte.
+template <typename T, typename... Args>
+SharedPtr<T> MakeSharedSharded(Args&&... args) {
+    return MakeSharedImp<T, ShardedControlBlock>(std::forward<Args>(args)...);
+}
+
+// Packs both counts into one word regardless of UseCompactRefCount<T>, saving
+// CompactRefCountSaving<T>() bytes.
+template <typename T, typename... Args>
+SharedPtr<T> MakeSharedCompact(Args&&... args) {
+    return MakeSharedImp<T, CompactControlBlock>(std::forward<Args>(args)...);
+}
+
+// count independent SharedPtrs whose blocks share one allocation: the blocks sit next to
+// each other in a slab, which is freed when the last of them is released. The i-th object is
+// initialized from make(i); a make that returns T constructs it in place.
+template <typename T, typename Make>
+std::vector<SharedPtr<T>> MakeSharedBatch(size_t count, Make&& make) {
+    static_assert(!std::is_array_v<T>);
+    using Block = ControlBlockBatchImp<T, ControlBlockBase<T>>;
+    if constexpr (std::is_same_v<ControlBlockBase<T>, BiasedControlBlock>)
+        MergeBiasedRefCounts();
+
+    std::vector<SharedPtr<T>> result;
+    if (count == 0)
+        return result;
+    result.reserve(count);
+    ControlBlockSlab* slab = new (Block::Allocate(count)) ControlBlockSlab{{count}};
+    Block* blocks = Block::Blocks(slab);
+    size_t built = 0;
+    try {
+        for (; built < count; ++built)
+            new (blocks + built) Block(slab, make, built);
+    } catch (...) {
+        while (built > 0)
+            blocks[--built].~Block();
+        Block::Deallocate(slab);
+        throw;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        ControlBlock* block = blocks + i;
+        result.push_back(SharedPtr<T>(block, blocks[i].GetObject()));
+    }
+    return result;
+}
+
+template <typename T>
+std::vector<SharedPtr<T>> MakeSharedBatch(size_t count) {
+    return MakeSharedBatch<T>(count, [](size_t) { return T(); });
+}
+
+// Frees an object made by MakeUniqueShareable together with the space reserved for its block.
+template <typename T>
+struct ShareableDeleter {
+    void operator()(T* ptr_) const {
+        using Block = ControlBlockShareableImp<T, ControlBlockBase<T>>;
+        void* buffer = Block::BufferOf(ptr_);
+        ptr_->~T();
+        Block::Deallocate(buffer);
+    }
+};
+
+template <typename T>
+using ShareableUniquePtr = UniquePtr<T, ShareableDeleter<T>>;
+
+// A UniquePtr that can later become a SharedPtr without another allocation. Costs the size of
+// a control block per object, in exchange the promotion is as cheap as MakeShared.
+template <typename T, typename... Args>
+ShareableUniquePtr<T> MakeUniqueShareable(Args&&... args) {
+    static_assert(!std::is_array_v<T>);
+    using Block = ControlBlockShareableImp<T, ControlBlockBase<T>>;
+    void* buffer = Block::Allocate();
+    try {
+        void* object = static_cast<char*>(buffer) + Block::Offset();
+        return ShareableUniquePtr<T>(new (object) T(std::forward<Args>(args)...));
+    } catch (...) {
+        Block::Deallocate(buffer);
         throw;
     }
 }
 
 class EnableSharedFromThisBase {};
 
+// Keeps only the control block of the SharedPtr that took ownership of the object, one word
+// and no weak reference: the block is freed after the object, so it is valid for the whole
+// lifetime of the object. Once the use count has dropped to zero, in the destructor, the
+// block refuses new owners and SharedFromThis throws BadWeakPtr, as it does before any
+// SharedPtr owns the object.
 template <typename T>
 class EnableSharedFromThis : public EnableSharedFromThisBase {
 public:
@@ -210,33 +572,45 @@ public:
     EnableSharedFromThis& operator=(const EnableSharedFromThis&) = delete;
     EnableSharedFromThis(EnableSharedFromThis&&) = delete;
     EnableSharedFromThis& operator=(EnableSharedFromThis&&) = delete;
-    virtual ~EnableSharedFromThis() {
-    }
+    ~EnableSharedFromThis() = default;
 
     SharedPtr<T> SharedFromThis() {
-        auto shared = weak_this.Lock();
-        if (!shared) {
-            throw BadWeakPtr();
-        }
-        return shared;
+        return Share(static_cast<T*>(this));
     }
     SharedPtr<const T> SharedFromThis() const {
-        auto shared = weak_this.Lock();
-        if (!shared) {
-            throw BadWeakPtr();
-        }
-        return shared;
+        return Share(static_cast<const T*>(this));
     }
 
     WeakPtr<T> WeakFromThis() noexcept {
-        return weak_this;
+        return ShareWeak(static_cast<T*>(this));
     }
     WeakPtr<const T> WeakFromThis() const noexcept {
-        return WeakPtr<const T>(weak_this);
+        return ShareWeak(static_cast<const T*>(this));
     }
 
 private:
-    WeakPtr<T> weak_this;
+    template <typename U>
+    SharedPtr<U> Share(U* object) const {
+        if (!block || !block->IncRefIfNotZero())
+            throw BadWeakPtr();
+        SharedPtr<U> shared;
+        shared.block = block;
+        shared.obj = object;
+        return shared;
+    }
+
+    template <typename U>
+    WeakPtr<U> ShareWeak(U* object) const noexcept {
+        WeakPtr<U> weak;
+        if (block) {
+            block->IncWeakRef();
+            weak.block = block;
+            weak.obj = object;
+        }
+        return weak;
+    }
+
+    ControlBlock* block = nullptr;
 
     template <typename U>
     friend class SharedPtr;
@@ -10,14 +10,34 @@ class SharedPtr;
 template <typename T>
 class WeakPtr;
 
-class ControlBlock;
+template <typename T>
+class AtomicSharedPtr;
 
 template <typename T>
-class ControlBlockPointerImp;
+class CollectableSharedPtr;
 
 template <typename T>
+class ThinSharedPtr;
+
+template <typename K, typename V>
+class WeakKeyMap;
+
+template <typename Key, typename T, typename Hash, typename Equal>
+class WeakCache;
+
+class ControlBlock;
+
+class BiasedControlBlock;
+
+template <typename T, typename Base>
+class ControlBlockPointerImp;
+
+template <typename T, typename Base>
 class ControlBlockObjectImp;
 
+template <typename T>
+struct ShareableDeleter;
+
 class EnableSharedFromThisBase;
 
 template <typename T>
@@ -0,0 +1,50 @@
+#include <thread>
+#include <vector>
+#include "atomic_shared_ptr.h"
+#include "check.h"
+
+namespace {
+
+void FailureReturnsTheCurrentValue() {
+    SharedPtr<int> first = MakeShared<int>(1);
+    AtomicSharedPtr<int> atomic(first);
+    SharedPtr<int> expected = MakeShared<int>(1);
+    CHECK(!atomic.CompareExchange(expected, MakeShared<int>(2)));
+    CHECK(expected == first);
+    CHECK(atomic.CompareExchange(expected, MakeShared<int>(2)));
+    CHECK(*atomic.Load() == 2);
+
+    AtomicSharedPtr<int> empty;
+    CHECK(!empty.CompareExchange(expected, MakeShared<int>(3)));
+    CHECK(!expected);
+    CHECK(empty.CompareExchange(expected, MakeShared<int>(3)));
+    CHECK(*empty.Load() == 3);
+}
+
+// Each failed attempt retries with the value it was handed back, so every increment lands.
+void ConcurrentIncrements() {
+    constexpr int kThreads = 4;
+    constexpr int kIncrements = 2000;
+    AtomicSharedPtr<int> counter(MakeShared<int>(0));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&counter] {
+            SharedPtr<int> expected = counter.Load();
+            for (int i = 0; i < kIncrements; ++i) {
+                while (!counter.CompareExchange(expected, MakeShared<int>(*expected + 1))) {
+                }
+                expected = counter.Load();
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    CHECK(*counter.Load() == kThreads * kIncrements);
+}
+
+}  // namespace
+
+int main() {
+    FailureReturnsTheCurrentValue();
+    ConcurrentIncrements();
+}
@@ -0,0 +1,66 @@
+#include <thread>
+#include "check.h"
+#include "cycle_collector.h"
+#include "weak_ptr.h"
+
+namespace {
+
+struct Node {
+    CollectableSharedPtr<Node> next;
+
+    void Trace(CycleTracer& tracer) {
+        tracer(next);
+    }
+};
+
+void CollectsRing() {
+    CycleCollector& collector = CycleCollector::Local();
+    size_t before = collector.CollectedCount();
+    {
+        CollectableSharedPtr<Node> first = MakeCollectable<Node>();
+        first->next = MakeCollectable<Node>();
+        first->next->next = first;
+    }
+    collector.CollectAll();
+    CHECK(collector.CollectedCount() == before + 2);
+}
+
+// The worker never touches a CollectableSharedPtr, so it has no collector: dropping the last
+// outside reference there buffers nothing and leaves the ring alone. The ring is collected
+// once its own thread releases a reference into it.
+void DropOnThreadWithoutCollector() {
+    CycleCollector& collector = CycleCollector::Local();
+    size_t before = collector.CollectedCount();
+    SharedPtr<Node> outside;
+    WeakPtr<Node> weak;
+    {
+        CollectableSharedPtr<Node> first = MakeCollectable<Node>();
+        first->next = MakeCollectable<Node>();
+        first->next->next = first;
+        outside = first.Shared();
+        weak = outside;
+    }
+    collector.CollectAll();
+    CHECK(collector.CollectedCount() == before);
+
+    std::thread worker([moved = std::move(outside)]() mutable {
+        moved.Reset();
+        CHECK(cycle_candidate_hook == nullptr);
+    });
+    worker.join();
+    collector.CollectAll();
+    CHECK(collector.CollectedCount() == before);
+    CHECK(!weak.Expired());
+
+    weak.Lock().Reset();
+    collector.CollectAll();
+    CHECK(collector.CollectedCount() == before + 2);
+    CHECK(weak.Expired());
+}
+
+}  // namespace
+
+int main() {
+    CollectsRing();
+    DropOnThreadWithoutCollector();
+}
@@ -0,0 +1,87 @@
+#include <utility>
+#include "check.h"
+#include "polymorphic_deleter.h"
+
+namespace {
+
+int destroyed = 0;
+
+struct Left {
+    int left = 1;
+};
+
+struct Right {
+    int right = 2;
+};
+
+// Right is not at the start of Both, converting to it moves the pointer.
+struct Both : Left, Right {
+    ~Both() {
+        ++destroyed;
+    }
+};
+
+struct Shared {
+    int shared = 3;
+};
+
+struct Virtual : virtual Shared {
+    ~Virtual() {
+        ++destroyed;
+    }
+};
+
+void ConversionKeepsDeleterInline() {
+    destroyed = 0;
+    int calls = 0;
+    auto deleter = [&calls](Both* both) {
+        ++calls;
+        delete both;
+    };
+    AnyUniquePtr<Both> both(UniquePtr<Both, decltype(deleter)>(new Both, deleter));
+    AnyUniquePtr<Right> right(std::move(both));
+    CHECK(!right.GetDeleter().IsAllocated());
+    CHECK(right->right == 2);
+    right.Reset();
+    CHECK(calls == 1 && destroyed == 1);
+}
+
+void ConversionKeepsAllocatedDeleter() {
+    destroyed = 0;
+    long a = 1, b = 2, c = 3;
+    auto deleter = [a, b, c](Both* both) {
+        destroyed += static_cast<int>(a + b + c);
+        delete both;
+    };
+    AnyUniquePtr<Both> both(UniquePtr<Both, decltype(deleter)>(new Both, deleter));
+    CHECK(both.GetDeleter().IsAllocated());
+    AnyUniquePtr<Right> right;
+    right = std::move(both);
+    CHECK(right.GetDeleter().IsAllocated());
+    right.Reset();
+    CHECK(destroyed == 7);
+}
+
+void VirtualBase() {
+    destroyed = 0;
+    AnyUniquePtr<Virtual> derived(new Virtual);
+    AnyUniquePtr<Shared> base(std::move(derived));
+    CHECK(base->shared == 3);
+    base.Reset();
+    CHECK(destroyed == 1);
+}
+
+void NullConversion() {
+    AnyUniquePtr<Both> both;
+    AnyUniquePtr<Right> right(std::move(both));
+    CHECK(!right);
+}
+
+}  // namespace
+
+int main() {
+    ConversionKeepsDeleterInline();
+    ConversionKeepsAllocatedDeleter();
+    VirtualBase();
+    NullConversion();
+}
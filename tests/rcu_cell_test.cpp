@@ -0,0 +1,52 @@
+#include "check.h"
+#include "rcu_cell.h"
+
+namespace {
+
+struct Config;
+
+RcuCell<Config>* cell = nullptr;
+int destroyed = 0;
+
+// Publishes a replacement from its destructor, which runs when the cell frees it.
+struct Config {
+    explicit Config(bool replace_) : replace(replace_) {
+    }
+    ~Config() {
+        ++destroyed;
+        if (replace)
+            cell->Store(MakeShared<Config>(false));
+    }
+
+    bool replace;
+};
+
+void DestructorMayStoreToTheSameCell() {
+    RcuCell<Config> config(MakeShared<Config>(true));
+    cell = &config;
+    config.Store(MakeShared<Config>(false));
+    config.Reclaim();
+    config.Store(MakeShared<Config>(false));
+    config.Reclaim();
+    CHECK(destroyed >= 1);
+    CHECK(!config.Read()->replace);
+}
+
+void ReadersKeepTheirValue() {
+    RcuCell<int> value(MakeShared<int>(1));
+    {
+        auto snapshot = value.Read();
+        value.Store(MakeShared<int>(2));
+        value.Reclaim();
+        CHECK(*snapshot == 1);
+    }
+    value.Reclaim();
+    CHECK(*value.Read() == 2);
+}
+
+}  // namespace
+
+int main() {
+    DestructorMayStoreToTheSameCell();
+    ReadersKeepTheirValue();
+}
@@ -0,0 +1,95 @@
+#include <memory>
+#include <new>
+#include "check.h"
+#include "shared_ptr.h"
+
+namespace {
+
+int destroyed = 0;
+
+struct Counted {
+    ~Counted() {
+        ++destroyed;
+    }
+};
+
+// Fails every allocation, for the path where the control block can't be allocated.
+template <typename T>
+struct FailingAllocator {
+    using value_type = T;
+
+    FailingAllocator() = default;
+    template <typename U>
+    FailingAllocator(const FailingAllocator<U>&) {
+    }
+
+    T* allocate(size_t) {
+        throw std::bad_alloc();
+    }
+    void deallocate(T*, size_t) {
+    }
+
+    template <typename U>
+    bool operator==(const FailingAllocator<U>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const FailingAllocator<U>&) const {
+        return false;
+    }
+};
+
+// An array from new[] has to be freed with delete[], ASan reports the mismatch otherwise.
+void AdoptedArrayIsDeletedAsArray() {
+    destroyed = 0;
+    {
+        SharedPtr<Counted[]> ptr(std::allocator_arg, std::allocator<Counted>(), new Counted[4]);
+        CHECK(ptr.UseCount() == 1);
+    }
+    CHECK(destroyed == 4);
+
+    SharedPtr<int[]> ints(std::allocator_arg, std::allocator<int>(), new int[8]());
+    ints[7] = 1;
+    CHECK(ints[7] == 1);
+}
+
+void ArrayIsDeletedAsArrayWhenBlockAllocationFails() {
+    destroyed = 0;
+    // Allocated in a statement of its own: GCC 12 destroys the elements of a new[] again when
+    // a later part of the same full-expression throws.
+    Counted* array = new Counted[3];
+    bool thrown = false;
+    try {
+        SharedPtr<Counted[]> ptr(std::allocator_arg, FailingAllocator<Counted>(), array);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(destroyed == 3);
+}
+
+void ScalarIsStillDeleted() {
+    destroyed = 0;
+    {
+        SharedPtr<Counted> ptr(std::allocator_arg, std::allocator<Counted>(), new Counted);
+    }
+    CHECK(destroyed == 1);
+
+    Counted* object = new Counted;
+    bool thrown = false;
+    try {
+        SharedPtr<Counted> ptr(std::allocator_arg, FailingAllocator<Counted>(), object);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(destroyed == 2);
+}
+
+}  // namespace
+
+int main() {
+    AdoptedArrayIsDeletedAsArray();
+    ArrayIsDeletedAsArrayWhenBlockAllocationFails();
+    ScalarIsStillDeleted();
+}
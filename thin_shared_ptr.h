@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>  // std::nullptr_t
+#include <stdexcept>
+#include <utility>
+#include "shared_ptr.h"
+
+// A SharedPtr of one word for objects that live inside their control block, as made by
+// MakeShared<T>: the object is found at a fixed offset from the block, so only the block is
+// stored. Aliasing SharedPtrs, pointers to a base class and objects from any other kind of
+// block (raw pointers, allocators, MakeSharedCompact without UseCompactRefCount) can't be
+// represented and are rejected when converted.
+template <typename T>
+class ThinSharedPtr {
+public:
+    using element_type = T;
+
+    ThinSharedPtr() noexcept : block(nullptr) {
+    }
+    ThinSharedPtr(std::nullptr_t) noexcept : block(nullptr) {
+    }
+
+    // Throws std::invalid_argument unless CanHold(ptr).
+    explicit ThinSharedPtr(const SharedPtr<T>& ptr) : block(Check(ptr)) {
+        if (block)
+            block->IncRef();
+    }
+    explicit ThinSharedPtr(SharedPtr<T>&& ptr) : block(Check(ptr)) {
+        ptr.block = nullptr;
+        ptr.obj = nullptr;
+    }
+
+    ThinSharedPtr(const ThinSharedPtr& other) noexcept : block(other.block) {
+        if (block)
+            block->IncRef();
+    }
+    ThinSharedPtr(ThinSharedPtr&& other) noexcept : block(other.block) {
+        other.block = nullptr;
+    }
+
+    ThinSharedPtr& operator=(const ThinSharedPtr& other) {
+        ThinSharedPtr(other).Swap(*this);
+        return *this;
+    }
+    ThinSharedPtr& operator=(ThinSharedPtr&& other) {
+        ThinSharedPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ~ThinSharedPtr() {
+        if (block)
+            block->DecRef();
+    }
+
+    static bool CanHold(const SharedPtr<T>& ptr) noexcept {
+        ControlBlock* other = ptr.block;
+        return !other || (other->HasOps(&ControlBlockOpsFor<Block, T>::value) &&
+                          static_cast<Block*>(other)->GetObject() == ptr.Get());
+    }
+
+    // Both conversions to SharedPtr only recompute the object address, the rvalue one also
+    // hands over the reference.
+    SharedPtr<T> Shared() const& {
+        SharedPtr<T> result;
+        if (block) {
+            block->IncRef();
+            result.block = block;
+            result.obj = Get();
+        }
+        return result;
+    }
+    SharedPtr<T> Shared() && {
+        SharedPtr<T> result;
+        result.obj = Get();
+        result.block = std::exchange(block, nullptr);
+        return result;
+    }
+
+    void Reset() {
+        ThinSharedPtr().Swap(*this);
+    }
+    void Swap(ThinSharedPtr& other) {
+        std::swap(block, other.block);
+    }
+
+    T* Get() const {
+        return block ? static_cast<Block*>(block)->GetObject() : nullptr;
+    }
+    T& operator*() const {
+        return *Get();
+    }
+    T* operator->() const {
+        return Get();
+    }
+    size_t UseCount() const {
+        if (!block)
+            return 0;
+        return block->UseCount();
+    }
+    explicit operator bool() const {
+        return block != nullptr;
+    }
+
+private:
+    using Block = ControlBlockObjectImp<T, ControlBlockBase<T>>;
+
+    static ControlBlock* Check(const SharedPtr<T>& ptr) {
+        if (!CanHold(ptr))
+            throw std::invalid_argument("ThinSharedPtr needs an object made by MakeShared");
+        return ptr.block;
+    }
+
+    ControlBlock* block;
+};
+
+template <typename T>
+struct IsTriviallyRelocatable<ThinSharedPtr<T>> : std::true_type {};
+
+template <typename T, typename U>
+inline bool operator==(const ThinSharedPtr<T>& left, const ThinSharedPtr<U>& right) {
+    return left.Get() == right.Get();
+}
+
+// MakeShared always builds the block ThinSharedPtr expects, so this never throws
+// std::invalid_argument.
+template <typename T, typename... Args>
+ThinSharedPtr<T> MakeThinShared(Args&&... args) {
+    return ThinSharedPtr<T>(MakeShared<T>(std::forward<Args>(args)...));
+}
+
+static_assert(sizeof(ThinSharedPtr<int>) == sizeof(void*));
@@ -1,8 +1,16 @@
 #pragma once
 
 #include "compressed_pair.h"
+#include "instrumentation.h"
+#include "relocate.h"
 
+#include <algorithm>
 #include <cstddef>  // std::nullptr_t
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
 template <typename T>
 struct DefaultDeleter {
@@ -29,26 +37,123 @@ struct DefaultDeleter<T[]> {
     }
 };
 
+template <typename T>
+struct AlignedDeleter;
+
+// For arrays from MakeUniqueAligned and MakeUniqueForOverwrite. The element count and the
+// alignment are kept in a header right in front of the elements, so the deleter has no state.
+template <typename T>
+struct AlignedDeleter<T[]> {
+    struct Header {
+        size_t count;
+        size_t alignment;
+        void* buffer;
+    };
+
+    AlignedDeleter() noexcept = default;
+
+    static Header* HeaderOf(const T* ptr_) {
+        return reinterpret_cast<Header*>(const_cast<T*>(ptr_)) - 1;
+    }
+
+    // Constructs nothing, the elements are up to the caller. The buffer comes from the plain
+    // operator new with room to align by hand: the aligned one is slower, and compilers don't
+    // know that its memory aliases nothing, which keeps loops over the elements scalar.
+    static T* Allocate(size_t count, size_t alignment) {
+        uintptr_t mask = std::max(alignment, alignof(Header)) - 1;
+        size_t slack = sizeof(Header) + mask;
+        if (count > (SIZE_MAX - slack) / sizeof(T))
+            ThrowBadLength();
+        char* buffer = static_cast<char*>(::operator new(slack + count * sizeof(T)));
+        uintptr_t first = reinterpret_cast<uintptr_t>(buffer) + sizeof(Header);
+        T* elements = reinterpret_cast<T*>((first + mask) & ~mask);
+        new (HeaderOf(elements)) Header{count, alignment, buffer};
+        return elements;
+    }
+    static void Deallocate(T* ptr_) {
+        ::operator delete(HeaderOf(ptr_)->buffer);
+    }
+
+    // Out of line, so the factories stay small enough to be inlined and the compiler sees
+    // where the buffer comes from.
+    [[noreturn]] static void ThrowBadLength() {
+        throw std::bad_array_new_length();
+    }
+    [[noreturn]] static void ThrowBadAlignment() {
+        throw std::invalid_argument("MakeUniqueAligned: alignment is not a power of two");
+    }
+
+    static size_t Size(const T* ptr_) {
+        return HeaderOf(ptr_)->count;
+    }
+    static size_t Alignment(const T* ptr_) {
+        return HeaderOf(ptr_)->alignment;
+    }
+
+    void operator()(T* ptr_) const {
+        static_assert(sizeof(T) > 0);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for (size_t i = Size(ptr_); i > 0; --i)
+                ptr_[i - 1].~T();
+        }
+        Deallocate(ptr_);
+    }
+};
+
+// Whether Deleter can be built from a deleter D of U* pointers and remember U, so that it
+// calls D with the pointer type D was made for, see PolymorphicDeleter. It is also given how
+// far the converted pointer lies inside the object.
+template <typename Deleter, typename U, typename D>
+inline constexpr bool kAdoptsPointerType =
+    std::is_constructible_v<Deleter, std::in_place_type_t<U>, D, std::ptrdiff_t>;
+
+// How far the T inside *ptr is from the start of *ptr, 0 for a null ptr.
+template <typename T, typename U>
+std::ptrdiff_t BaseOffset(U* ptr) noexcept {
+    if (!ptr)
+        return 0;
+    return reinterpret_cast<const char*>(static_cast<const T*>(ptr)) -
+           reinterpret_cast<const char*>(ptr);
+}
+
+// The deleter of a UniquePtr<T, Deleter> converted from a UniquePtr<U, D> holding ptr.
+template <typename Deleter, typename T, typename U, typename D>
+Deleter ConvertDeleter(D&& deleter, U* ptr) noexcept(
+    kAdoptsPointerType<Deleter, U, D&&>
+        ? std::is_nothrow_constructible_v<Deleter, std::in_place_type_t<U>, D&&, std::ptrdiff_t>
+        : std::is_nothrow_constructible_v<Deleter, D&&>) {
+    if constexpr (kAdoptsPointerType<Deleter, U, D&&>)
+        return Deleter(std::in_place_type<U>, std::forward<D>(deleter), BaseOffset<T>(ptr));
+    else
+        return Deleter(std::forward<D>(deleter));
+}
+
 template <typename T, typename Deleter = DefaultDeleter<T>>
 class UniquePtr {
 public:
     explicit UniquePtr(T* ptr = nullptr) noexcept : UniquePtr(ptr, Deleter()) {
     }
     UniquePtr(T* ptr, Deleter&& deleter) noexcept : data_(ptr, std::forward<Deleter>(deleter)) {
+        Trace(ptr, InstrumentedEvent::kAllocate);
     }
 
     UniquePtr(T* ptr, const Deleter& deleter) noexcept : data_(ptr, deleter) {
+        Trace(ptr, InstrumentedEvent::kAllocate);
     }
 
     UniquePtr(UniquePtr&& other) noexcept
         : data_(other.Release(), std::forward<Deleter>(other.GetDeleter())) {
     }
 
+    // If converting the deleter throws, other keeps its object.
     template <typename Tp, typename DeleterType,
               typename = typename std::enable_if_t<
                   std::__and_v<std::is_convertible<Tp*, T*>, std::__not_<std::is_array<Tp>>>>>
-    UniquePtr(UniquePtr<Tp, DeleterType>&& other) noexcept
-        : data_(other.Release(), std::forward<Deleter>(other.GetDeleter())) {
+    UniquePtr(UniquePtr<Tp, DeleterType>&& other) noexcept(
+        noexcept(ConvertDeleter<Deleter, T>(std::declval<DeleterType>(), std::declval<Tp*>())))
+        : data_(other.Get(),
+                ConvertDeleter<Deleter, T>(std::move(other.GetDeleter()), other.Get())) {
+        other.Release();
     }
 
     UniquePtr(const UniquePtr&) = delete;
@@ -56,7 +161,7 @@ public:
     UniquePtr& operator=(const UniquePtr&) = delete;
 
     UniquePtr& operator=(UniquePtr&& other) noexcept {
-        Reset(other.Release());
+        Replace(other.Release());
         GetDeleter() = std::forward<Deleter>(other.GetDeleter());
         return *this;
     }
@@ -64,9 +169,11 @@ public:
     template <typename Tp, typename DeleterType,
               typename = typename std::enable_if_t<
                   std::__and_v<std::is_convertible<Tp*, T*>, std::__not_<std::is_array<Tp>>>>>
-    UniquePtr& operator=(UniquePtr<Tp, DeleterType>&& other) noexcept {
-        Reset(other.Release());
-        GetDeleter() = std::forward<Deleter>(other.GetDeleter());
+    UniquePtr& operator=(UniquePtr<Tp, DeleterType>&& other) noexcept(
+        noexcept(ConvertDeleter<Deleter, T>(std::declval<DeleterType>(), std::declval<Tp*>()))) {
+        Deleter deleter = ConvertDeleter<Deleter, T>(std::move(other.GetDeleter()), other.Get());
+        Replace(other.Release());
+        GetDeleter() = std::move(deleter);
         return *this;
     }
 
@@ -78,6 +185,7 @@ public:
     ~UniquePtr() {
         auto& ptr_ = data_.GetFirst();
         if (ptr_ != nullptr) {
+            Trace(ptr_, InstrumentedEvent::kFree);
             GetDeleter()(ptr_);
             ptr_ = nullptr;
         }
@@ -90,10 +198,8 @@ public:
     }
 
     void Reset(T* ptr = nullptr) {
-        std::swap(ptr, data_.GetFirst());
-        if (ptr != nullptr) {
-            GetDeleter()(ptr);
-        }
+        Trace(ptr, InstrumentedEvent::kAllocate);
+        Replace(ptr);
     }
 
     void Swap(UniquePtr& other) {
@@ -123,6 +229,23 @@ public:
     }
 
 private:
+    // Counts objects adopted from a raw pointer and destroyed through the deleter, moves
+    // between UniquePtrs are not events. Objects given away with Release stay counted as live.
+    void Replace(T* ptr) {
+        std::swap(ptr, data_.GetFirst());
+        if (ptr != nullptr) {
+            Trace(ptr, InstrumentedEvent::kFree);
+            GetDeleter()(ptr);
+        }
+    }
+
+    static void Trace(T* ptr, InstrumentedEvent event) {
+        if constexpr (kInstrumentation) {
+            if (ptr)
+                Instrumentation::Record(InstrumentedTypeOf<T>(), event);
+        }
+    }
+
     CompressedPair<T*, Deleter> data_;
 };
 
@@ -227,6 +350,61 @@ public:
         return Get()[ind];
     }
 
+    // Only with a deleter that knows the allocation, such as AlignedDeleter.
+    size_t Size() const {
+        return Get() ? GetDeleter().Size(Get()) : 0;
+    }
+    size_t Alignment() const {
+        return Get() ? GetDeleter().Alignment(Get()) : 0;
+    }
+
 private:
     CompressedPair<T*, Deleter> data_;
-};
\ No newline at end of file
+};
+
+template <typename T, typename Deleter>
+struct IsTriviallyRelocatable<UniquePtr<T, Deleter>> : IsTriviallyRelocatable<Deleter> {};
+
+template <typename T>
+using AlignedUniquePtr = UniquePtr<T, AlignedDeleter<T>>;
+
+// count default-initialized elements aligned to alignment, which has to be a power of two.
+// Trivial types stay uninitialized. If a constructor throws, the elements built so far are
+// destroyed.
+template <typename T>
+std::enable_if_t<std::is_array_v<T> && std::extent_v<T> == 0, AlignedUniquePtr<T>>
+MakeUniqueAligned(size_t count, size_t alignment) {
+    using Element = std::remove_extent_t<T>;
+    using Deleter = AlignedDeleter<T>;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        Deleter::ThrowBadAlignment();
+    alignment = std::max(alignment, alignof(Element));
+    Element* elements = Deleter::Allocate(count, alignment);
+    if constexpr (std::is_trivially_default_constructible_v<Element>)
+        return AlignedUniquePtr<T>(elements);
+    size_t built = 0;
+    try {
+        for (; built < count; ++built)
+            ::new (static_cast<void*>(elements + built)) Element;
+    } catch (...) {
+        while (built > 0)
+            elements[--built].~Element();
+        Deleter::Deallocate(elements);
+        throw;
+    }
+    return AlignedUniquePtr<T>(elements);
+}
+
+// Like MakeUniqueAligned at the natural alignment of the elements.
+template <typename T>
+std::enable_if_t<std::is_array_v<T> && std::extent_v<T> == 0, AlignedUniquePtr<T>>
+MakeUniqueForOverwrite(size_t count) {
+    return MakeUniqueAligned<T>(count, alignof(std::remove_extent_t<T>));
+}
+
+template <typename T>
+std::enable_if_t<!std::is_array_v<T>, UniquePtr<T>> MakeUniqueForOverwrite() {
+    return UniquePtr<T>(new T);
+}
+
+static_assert(sizeof(AlignedUniquePtr<float[]>) == sizeof(void*));
\ No newline at end of file
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include "intrusive_ptr.h"
+#include "shared_ptr.h"
+#include "unique_ptr.h"
+#include "weak_ptr.h"
+
+// Intern table: at most one live T per key, shared by everyone who asks for it, and dropped
+// from the table when its last owner releases it. The table holds only WeakPtrs. Objects are
+// created by the cache in blocks that erase their own entry when the object is destroyed, so
+// dead slots are reclaimed without scanning. Keys are spread over shards with a lock each.
+template <typename Key, typename T, typename Hash = std::hash<Key>,
+          typename Equal = std::equal_to<Key>>
+class WeakCache {
+public:
+    static constexpr size_t kDefaultShards = 64;
+
+    // shards is rounded up to a power of two.
+    explicit WeakCache(size_t shards = kDefaultShards) : core(new Core(shards)) {
+    }
+
+    WeakCache(const WeakCache&) = delete;
+    WeakCache& operator=(const WeakCache&) = delete;
+
+    // Objects may outlive the cache, they keep the shards alive but are no longer found.
+    ~WeakCache() {
+        for (size_t i = 0; i < core->shard_count; ++i) {
+            Map entries;
+            Shard& shard = core->shards[i];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            entries.swap(shard.map);
+        }
+    }
+
+    // Returns the live object for key, or creates it from factory(). A factory returning T
+    // constructs it in place. It runs under the lock of the key's shard, so it must not use
+    // this cache.
+    template <typename Factory>
+    SharedPtr<T> GetOrCreate(const Key& key, Factory&& factory) {
+        // Declared before the lock: should the result die on the way out, its block takes
+        // the lock again to erase the entry.
+        SharedPtr<T> result;
+        WeakPtr<T> stale;
+        Shard& shard = core->ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(&key);
+        if (it != shard.map.end()) {
+            result = it->second.Lock();
+            if (result)
+                return result;
+            // The object is being destroyed, its block will see that the entry is not
+            // its own any more.
+            stale = std::move(it->second);
+            shard.map.erase(it);
+        }
+        if constexpr (std::is_same_v<ControlBlockBase<T>, BiasedControlBlock>)
+            MergeBiasedRefCounts();
+        Block* block = Block::Create(core, key, factory);
+        result = SharedPtr<T>(static_cast<ControlBlock*>(block), block->GetObject());
+        shard.map.emplace(&block->key, WeakPtr<T>(result));
+        return result;
+    }
+
+    // nullptr unless a live object for key is cached.
+    SharedPtr<T> Get(const Key& key) const {
+        SharedPtr<T> result;
+        Shard& shard = core->ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(&key);
+        if (it != shard.map.end())
+            result = it->second.Lock();
+        return result;
+    }
+
+    // Includes objects whose destruction has started but not reached the table yet.
+    size_t Size() const {
+        size_t size = 0;
+        for (size_t i = 0; i < core->shard_count; ++i) {
+            std::lock_guard<std::mutex> lock(core->shards[i].mutex);
+            size += core->shards[i].map.size();
+        }
+        return size;
+    }
+
+private:
+    // The table points at the keys stored in the blocks, an entry keeps its block alive.
+    struct KeyHash {
+        size_t operator()(const Key* key) const {
+            return Hash()(*key);
+        }
+    };
+    struct KeyEqual {
+        bool operator()(const Key* left, const Key* right) const {
+            return Equal()(*left, *right);
+        }
+    };
+    using Map = std::unordered_map<const Key*, WeakPtr<T>, KeyHash, KeyEqual>;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        Map map;
+    };
+
+    // Shared by the cache and its blocks, so a block can always reach its shard.
+    struct Core : RefCounted<Core> {
+        explicit Core(size_t shards_) : shard_bits(0) {
+            while ((size_t(1) << shard_bits) < shards_)
+                ++shard_bits;
+            shard_count = size_t(1) << shard_bits;
+            shards = UniquePtr<Shard[]>(new Shard[shard_count]);
+        }
+
+        // The top bits of a multiplicative hash, the map uses the low bits of the plain one.
+        Shard& ShardOf(const Key& key) {
+            if (shard_bits == 0)
+                return shards[0];
+            uint64_t hash = static_cast<uint64_t>(Hash()(key)) * 0x9E3779B97F4A7C15ull;
+            return shards[hash >> (64 - shard_bits)];
+        }
+
+        // Erases the entry of key if it still belongs to the dying block.
+        void Forget(const Key& key) {
+            WeakPtr<T> entry;
+            Shard& shard = ShardOf(key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.map.find(&key);
+            if (it == shard.map.end() || it->first != &key)
+                return;
+            entry = std::move(it->second);
+            shard.map.erase(it);
+        }
+
+        size_t shard_bits;
+        size_t shard_count;
+        UniquePtr<Shard[]> shards;
+    };
+
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    class Block : public ControlBlockBase<T> {
+    public:
+        template <typename Factory>
+        static Block* Create(const IntrusivePtr<Core>& core_, const Key& key_, Factory& factory) {
+            void* buffer = ::operator new(sizeof(Block));
+            try {
+                return new (buffer) Block(core_, key_, factory);
+            } catch (...) {
+                ::operator delete(buffer);
+                throw;
+            }
+        }
+
+        template <typename Factory>
+        Block(const IntrusivePtr<Core>& core_, const Key& key_, Factory& factory)
+            : ControlBlockBase<T>(&ControlBlockOpsFor<Block, T>::value), core(core_), key(key_),
+              object(factory()) {
+        }
+        ~Block() = default;
+
+        T* GetObject() {
+            return &object;
+        }
+
+        // The entry goes after the object: a destructor that releases other cached objects
+        // must not run under a shard lock.
+        void DelObject() {
+            object.~T();
+            core->Forget(key);
+        }
+
+        void DelThis() {
+            key.~Key();
+            core.~IntrusivePtr<Core>();
+            ::operator delete(this);
+        }
+
+        void* ObjectAddress() {
+            return const_cast<void*>(static_cast<const void*>(&object));
+        }
+
+        IntrusivePtr<Core> core;
+        const Key key;
+        T object;
+    };
+
+    IntrusivePtr<Core> core;
+};
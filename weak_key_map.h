@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include "owner_less.h"
+
+// A hash map keyed by objects it does not keep alive. Keys are held as WeakPtrs and looked up
+// by their control block, so a lookup with a SharedPtr or WeakPtr costs no reference count
+// traffic. Entries of expired keys can't be found any more; they are purged lazily, whenever
+// an insert would grow the table, by ForEach and by Purge. Not thread-safe.
+template <typename K, typename V>
+class WeakKeyMap {
+public:
+    WeakKeyMap() = default;
+
+    // Inserts V(args...) unless key is present. Returns the value and whether it was
+    // inserted. key must not be empty.
+    template <typename U, typename... Args>
+    std::pair<V*, bool> TryEmplace(const SharedPtr<U>& key, Args&&... args) {
+        auto it = map.find(key.block);
+        if (it != map.end())
+            return {&it->second.value, false};
+        if (map.size() + 1 > map.max_load_factor() * map.bucket_count())
+            Purge();
+        it = map.emplace(std::piecewise_construct, std::forward_as_tuple(key.block),
+                         std::forward_as_tuple(key, std::forward<Args>(args)...))
+                 .first;
+        return {&it->second.value, true};
+    }
+
+    template <typename U>
+    V& operator[](const SharedPtr<U>& key) {
+        return *TryEmplace(key).first;
+    }
+
+    // nullptr if key is absent. P is a SharedPtr or a WeakPtr.
+    template <typename P>
+    V* Find(const P& key) {
+        auto it = map.find(key.block);
+        return it == map.end() ? nullptr : &it->second.value;
+    }
+    template <typename P>
+    const V* Find(const P& key) const {
+        auto it = map.find(key.block);
+        return it == map.end() ? nullptr : &it->second.value;
+    }
+    template <typename P>
+    bool Contains(const P& key) const {
+        return Find(key) != nullptr;
+    }
+
+    template <typename P>
+    bool Erase(const P& key) {
+        return map.erase(key.block) != 0;
+    }
+
+    // Removes the entries of expired keys, returns how many.
+    size_t Purge() {
+        size_t purged = 0;
+        for (auto it = map.begin(); it != map.end();) {
+            if (it->second.key.Expired()) {
+                it = map.erase(it);
+                ++purged;
+            } else {
+                ++it;
+            }
+        }
+        return purged;
+    }
+
+    // Calls f(SharedPtr<K>, V&) for every live entry and purges the expired ones on the way.
+    template <typename F>
+    void ForEach(F&& f) {
+        for (auto it = map.begin(); it != map.end();) {
+            SharedPtr<K> key = it->second.key.Lock();
+            if (!key) {
+                it = map.erase(it);
+                continue;
+            }
+            f(key, it->second.value);
+            ++it;
+        }
+    }
+
+    // Includes expired entries that have not been purged yet.
+    size_t Size() const {
+        return map.size();
+    }
+    bool Empty() const {
+        return map.empty();
+    }
+    void Clear() {
+        map.clear();
+    }
+
+private:
+    struct Entry {
+        template <typename... Args>
+        Entry(const WeakPtr<K>& key_, Args&&... args)
+            : key(key_), value(std::forward<Args>(args)...) {
+        }
+
+        // Keeps the control block, and so its address, reserved for this entry.
+        WeakPtr<K> key;
+        V value;
+    };
+
+    std::unordered_map<ControlBlock*, Entry> map;
+};
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <functional>
 #include "shared_weak_fwd.h"
 #include "control_block.h"
+#include "relocate.h"
 
 template <typename T>
 class WeakPtr {
 public:
+    using element_type = std::remove_extent_t<T>;
+
     WeakPtr() noexcept : block(nullptr), obj(nullptr) {
     }
 
@@ -112,13 +116,44 @@ public:
         return SharedPtr<T>(*this, std::nothrow);
     }
 
+    // Ownership-based ordering, equality and hashing: pointers sharing a control block are
+    // equivalent whatever they point to. Expired WeakPtrs work without being locked.
+    template <typename U>
+    bool OwnerBefore(const SharedPtr<U>& other) const noexcept {
+        return std::less<ControlBlock*>()(block, other.block);
+    }
+    template <typename U>
+    bool OwnerBefore(const WeakPtr<U>& other) const noexcept {
+        return std::less<ControlBlock*>()(block, other.block);
+    }
+    template <typename U>
+    bool OwnerEqual(const SharedPtr<U>& other) const noexcept {
+        return block == other.block;
+    }
+    template <typename U>
+    bool OwnerEqual(const WeakPtr<U>& other) const noexcept {
+        return block == other.block;
+    }
+    size_t OwnerHash() const noexcept {
+        return std::hash<ControlBlock*>()(block);
+    }
+
 private:
     ControlBlock* block;
-    T* obj;
+    element_type* obj;
 
     template <typename U>
     friend class SharedPtr;
 
     template <typename U>
     friend class WeakPtr;
+
+    template <typename K, typename V>
+    friend class WeakKeyMap;
+
+    template <typename U>
+    friend class EnableSharedFromThis;
 };
+
+template <typename T>
+struct IsTriviallyRelocatable<WeakPtr<T>> : std::true_type {};